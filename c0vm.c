@@ -6,51 +6,138 @@
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib/xalloc.h"
-#include "lib/stack.h"
 #include "lib/contracts.h"
-#include "lib/c0v_stack.h"
 #include "lib/c0vm.h"
+#include "lib/c0vm_callstack.h"
 #include "lib/c0vm_c0ffi.h"
 #include "lib/c0vm_abort.h"
+#include "lib/c0vm_dynamic.h"
+#include "lib/c0vm_fault.h"
+#include "lib/c0vm_int.h"
+#include "lib/c0vm_io.h"
+#include "lib/c0vm_memo.h"
+#include "lib/c0vm_simd.h"
+#include "lib/c0vm_strings.h"
+#include "lib/c0vm_vector.h"
+
+/* Null checks for the memory opcodes.  With IMPLICIT_NULL_CHECKS there
+ * is no test at all: the instruction is recorded for the SIGSEGV handler
+ * in lib/c0vm_fault.c, and the compiler barrier keeps the recording
+ * ahead of the access itself. */
+#ifdef IMPLICIT_NULL_CHECKS
+#define CHECK_NULL(A) \
+  do { \
+    c0vm_fault_site.P = P; \
+    c0vm_fault_site.pc = pc - 1; \
+    __asm__ __volatile__("" ::: "memory"); \
+  } while (0)
+#else
+#define CHECK_NULL(A) \
+  do { if ((A) == NULL) c0_memory_error("Memory error"); } while (0)
+#endif
 
-/* call stack frames */
-typedef struct frame_info frame;
-struct frame_info {
-  c0v_stack_t S;   /* Operand stack of C0 values */
-  ubyte *P;        /* Function body */
-  size_t pc;       /* Program counter */
-  c0_value *V;     /* The local variables */
-};
+/* The operand stack of the current function sits right above its
+ * locals in the call stack's value array, from S up to sp */
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+
+/* Operands of the register forms (see lib/c0vm.h) */
+#define REG_X() val2int(V[P[pc+2]])
+#define REG_Y() \
+  (P[pc] & REG_IMM ? (int)(byte)P[pc+3] : val2int(V[P[pc+3]]))
+#define REG_RESULT(r) \
+  do { \
+    if (P[pc+1] == REG_PUSH) PUSH(int2val(r)); \
+    else V[P[pc+1]] = int2val(r); \
+    pc += 4; \
+  } while (0)
+#define REG_BRANCH(cond) \
+  do { pc += (cond) ? (int16_t)(P[pc+3] << 8 | P[pc+4]) : 5; } while (0)
+
+/* The dub and fpt intrinsics replace their two operands lhs and rhs by e */
+#define DUB_OP(e) \
+  do { \
+    double lhs = val2dbl(sp[-2]), rhs = val2dbl(sp[-1]); \
+    sp -= 1; \
+    sp[-1] = (e); \
+    pc += 3; \
+  } while (0)
+#define FPT_OP(e) \
+  do { \
+    float lhs = fpt2float(val2int(sp[-2])); \
+    float rhs = fpt2float(val2int(sp[-1])); \
+    sp -= 1; \
+    sp[-1] = (e); \
+    pc += 3; \
+  } while (0)
+
+/* Boxes *v if it is an unboxed dub, the first time it leaves the VM's
+ * values: when it is stored in memory, passed to a native or tagged.
+ * Every unboxed copy of it in the current frame [V, end) gets the same
+ * box, so later stores reuse it and == on dubs stays pointer identity,
+ * as in the library */
+static void box_dub(c0_value *v, c0_value *V, c0_value *end) {
+  if (v->kind != C0_DOUBLE) return;
+  double d = v->payload.d;
+  c0_value box = ptr2val(val2ptr(*v));
+  for (c0_value *u = V; u < end; u++) {
+    if (u->kind == C0_DOUBLE
+        && memcmp(&u->payload.d, &d, sizeof(double)) == 0)
+      *u = box;
+  }
+  *v = box;
+}
+
+/* The library version of the intrinsic at P[pc], for arguments where it
+ * raises an error, so that the intrinsics fail exactly like the natives */
+static c0_value native_fallback(struct bc0_file *bc0, ubyte *P, size_t pc,
+                                c0_value *args) {
+  struct native_info *ni = &bc0->native_pool[P[pc+1] << 8 | P[pc+2]];
+  for (size_t i = 0; i < ni->num_args; i++) flatten_value(&args[i]);
+#ifdef IMPLICIT_NULL_CHECKS
+  c0vm_fault_site.P = NULL; // faults in native code are not ours
+#endif
+  return ni->fn(args);
+}
 
 int execute(struct bc0_file *bc0) {
   REQUIRES(bc0 != NULL);
 
-  /* Variables */
-  c0v_stack_t S = c0v_stack_new(); /* Operand stack of C0 values */
+  /* The call stack: records of suspended callers, and one array with
+   * the locals and operand stacks of all active functions */
+  c0vm_fault_init(bc0);
+  io_init();
+  struct function_info *main_fn = &bc0->function_pool[0];
+  if (main_fn->int_only) {
+    int result = execute_int(bc0, main_fn, NULL);
+    execute_int_done();
+    memo_done(bc0);
+    strings_done();
+    return result;
+  }
+
+  callstack_t callStack = callstack_new();
 
   // Initialize for P, the byte code for the function 
-  ubyte *P = bc0->function_pool->code; // Allocate for P 
+  ubyte *P = main_fn->code;
 
   size_t pc = 0;     /* Current location within the current byte array P */
 
-  size_t num_vars = (size_t) bc0->function_pool->num_vars; 
-  c0_value *V = xcalloc(num_vars, sizeof(c0_value));   /* Local variables (you won't need this till Task 2) */
+  c0_value *V = callStack->values;   /* Local variables */
+  for (size_t i = 0; i < main_fn->num_vars; i++) V[i] = int2val(0);
 
-  //(void) V;         // silences compilation errors about V being currently unused
-
-  /* The call stack, a generic stack that should contain pointers to frames */
-  /* You won't need this until you implement functions. */
-  gstack_t callStack = stack_new();
-  (void) callStack; // silences compilation errors about callStack being currently unused
+  c0_value *S = V + main_fn->num_vars;  /* Operand stack of C0 values */
+  c0_value *sp = S;                     /* Top of the operand stack */
 
   while (true) {
 
 #ifdef DEBUG
     /* You can add extra debugging information here */
     fprintf(stderr, "Opcode %x -- Stack size: %zu -- PC: %zu\n",
-            P[pc], c0v_stack_size(S), pc);
+            P[pc], (size_t)(sp - S), pc);
 #endif
 
     switch (P[pc]) {
@@ -61,58 +148,55 @@ int execute(struct bc0_file *bc0) {
     c0_value v2;
 
     case POP: {
-      assert(!c0v_stack_empty(S));
+      assert(sp > S);
       pc++;
-      c0v_pop(S);
+      sp--;
       break;
     }
 
     case DUP: {
-      assert(!c0v_stack_empty(S));
+      assert(sp > S);
       pc++;
-      c0_value v = c0v_pop(S);
-      c0v_push(S,v);
-      c0v_push(S,v);
+      c0_value v = POP();
+      PUSH(v);
+      PUSH(v);
       break;
     }
 
     case SWAP:
       pc++; 
-      assert(!c0v_stack_empty(S)); // Safety 
-      v2 = c0v_pop(S);
-      assert(!c0v_stack_empty(S)); // Safety 
-      v1 = c0v_pop(S);
-      c0v_push(S, v2);
-      c0v_push(S, v1); 
+      assert(sp > S); // Safety 
+      v2 = POP();
+      assert(sp > S); // Safety 
+      v1 = POP();
+      PUSH(v2);
+      PUSH(v1); 
       break;
 
 
-    /* Returning from a function.
-     * This currently has a memory leak! You will need to make a slight
-     * change for the initial tasks to avoid leaking memory.  You will
-     * need to revise it further when you write INVOKESTATIC. */
+    /* Returning from a function. */
 
     case RETURN: {
-      c0_value retval = c0v_pop(S);
+      c0_value retval = POP();
       // Another way to print only in DEBUG mode
       // IF_DEBUG(fprintf(stderr, "Returning %d from execute()\n", val2int(retval)));
 
-      // Free everything before returning from the execute function! 
-      free(V); // Free the local vars 
-      c0v_stack_free(S); // Free the operand stack 
-
-      if(stack_empty(callStack)) {
-        stack_free(callStack, &free);
+      if(callStack->depth == 0) {
+        callstack_free(callStack); // Free the locals and operand stacks
+        execute_int_done();
+        memo_done(bc0);
+        strings_done();
         return val2int(retval); 
       }
       else { // otherwise, pick up the caller function 
-        frame* caller = (frame*) pop(callStack); 
-        S = caller->S; 
+        // The return value takes the place of the arguments
+        sp = V; 
+        frame* caller = callstack_pop(callStack); 
         P = caller->P; 
-        V = caller->V; 
         pc = caller->pc; 
-        free(caller);
-        c0v_push(S, retval); // push returned value into the stack
+        V = caller->V; 
+        S = caller->S; 
+        PUSH(retval); // push returned value into the stack
       }
 
       break; 
@@ -130,126 +214,126 @@ int execute(struct bc0_file *bc0) {
 
     case IADD: // Addition 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
       // printf("Calculating %d + %d\n", x, y);
 
       res = (int)((unsigned int)x + (unsigned int)y); // Deal with overflow
       // printf("Result is: %d\n", res);
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case ISUB: // Subtraction 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       res = (int)((unsigned int)x - (unsigned int)y); // Deal with overflow
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case IMUL: // Multiplication 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       res = (int)((unsigned int)x * (unsigned int)y); // Deal with overflow
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case IDIV: // Division 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       if(y == 0 || (x == -2147483648 && y == -1)){
         c0_arith_error("Division by 0 error");  
       } 
 
       res = x/y; 
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case IREM: // Modulus 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       if(y == 0 || (x == -2147483648 && y == -1)){
         c0_arith_error("Division by 0 error");  
       } 
 
       res = x%y; 
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case IAND: // The & bit operation 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       res = x&y; 
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case IOR: // The | bit operation 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       res = x|y; 
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case IXOR: // The ^ bit operation 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       res = x^y; 
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case ISHR: // The >> bit operation 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       if(!(0 <= y && y <= 31)) c0_arith_error("Shift by invalid numbe of bits");
 
       res = x>>y; 
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
     case ISHL: // The << bit operation 
       pc++; 
-      assert(!c0v_stack_empty(S));  // Safety 
-      y = val2int(c0v_pop(S)); 
-      assert(!c0v_stack_empty(S));  // Safety 
-      x = val2int(c0v_pop(S)); 
+      assert(sp > S);  // Safety 
+      y = val2int(POP()); 
+      assert(sp > S);  // Safety 
+      x = val2int(POP()); 
 
       if(!(0 <= y && y <= 31)) c0_arith_error("Shift by invalid numbe of bits");
 
       res = x<<y; 
-      c0v_push(S, int2val(res));
+      PUSH(int2val(res));
       break; 
 
 
@@ -261,7 +345,7 @@ int execute(struct bc0_file *bc0) {
       // printf("Pushed int is %d\n", pushed);
       c0_value val = int2val(pushed); // Record the next value to be pushed
       pc++; 
-      c0v_push(S, val); 
+      PUSH(val); 
       break; 
 
     case ILDC:
@@ -272,7 +356,7 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       res = (int) bc0->int_pool[(c1<<8)|c2]; // By definition 
-      c0v_push(S, int2val(res)); 
+      PUSH(int2val(res)); 
 
       break; 
 
@@ -284,14 +368,14 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       ptr = (void*) &bc0->string_pool[(c1<<8)|c2];
-      c0v_push(S, ptr2val(ptr)); 
+      PUSH(ptr2val(ptr)); 
 
       break; 
 
     case ACONST_NULL:
       pc++; 
       ptr = (void*) NULL; 
-      c0v_push(S, ptr2val(ptr));
+      PUSH(ptr2val(ptr));
       break; 
 
 
@@ -303,16 +387,16 @@ int execute(struct bc0_file *bc0) {
       pc++; 
       ind = P[pc]; // index in V
       pc++; 
-      c0v_push(S, V[ind]);
+      PUSH(V[ind]);
       break; 
 
     case VSTORE:
       pc++; 
       ind= P[pc]; 
       pc++; 
-      // constant = val2int(c0v_pop(S)); 
+      // constant = val2int(POP()); 
       // V[ind] = int2val(constant); 
-      V[ind] = c0v_pop(S); 
+      V[ind] = POP(); 
       break; 
 
 
@@ -322,14 +406,14 @@ int execute(struct bc0_file *bc0) {
 
     case ATHROW:
       pc++; 
-      a = val2ptr(c0v_pop(S));
+      a = string_chars(val2ptr(POP()));
       c0_user_error((char*) a); 
       break; 
 
     case ASSERT:
       pc++; 
-      a = val2ptr(c0v_pop(S));
-      x = val2int(c0v_pop(S)); 
+      a = string_chars(val2ptr(POP()));
+      x = val2int(POP()); 
 
       if(x == 0) c0_assertion_failure((char*) a); 
 
@@ -351,8 +435,8 @@ int execute(struct bc0_file *bc0) {
 
     case IF_CMPEQ:
       pc++; 
-      v1 = c0v_pop(S); 
-      v2 = c0v_pop(S); 
+      v1 = POP(); 
+      v2 = POP(); 
 
       o1 = P[pc]; 
       pc++; 
@@ -360,7 +444,7 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       offset1 = (int16_t) (byte) o1; 
-      offset2 = (int16_t) (byte) o2; 
+      offset2 = (int16_t) o2; 
 
       // Has to cancel the pc change from line 346 and 343 
       if(val_equal(v1, v2)) pc = pc+(offset1<<8|offset2) - 3; 
@@ -370,8 +454,8 @@ int execute(struct bc0_file *bc0) {
     // 0xA0 if_cmpne <o1,o2>  S, v1, v2 -> S       (pc = pc+(o1<<8|o2) if v1 != v2)  
     case IF_CMPNE:
       pc++; 
-      v1 = c0v_pop(S); 
-      v2 = c0v_pop(S); 
+      v1 = POP(); 
+      v2 = POP(); 
 
       o1 = P[pc]; 
       pc++; 
@@ -379,7 +463,7 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       offset1 = (int16_t) (byte) o1; 
-      offset2 = (int16_t) (byte) o2; 
+      offset2 = (int16_t) o2; 
 
       if(!val_equal(v1, v2)) pc = pc+(offset1<<8|offset2) - 3; 
 
@@ -388,8 +472,8 @@ int execute(struct bc0_file *bc0) {
     // 0xA1 if_icmplt <o1,o2> S, x:w32, y:w32 -> S (pc = pc+(o1<<8|o2) if x < y) 
     case IF_ICMPLT:
       pc++; 
-      y = val2int(c0v_pop(S)); 
-      x = val2int(c0v_pop(S)); 
+      y = val2int(POP()); 
+      x = val2int(POP()); 
 
       o1 = P[pc]; 
       pc++; 
@@ -397,7 +481,7 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       offset1 = (int16_t) (byte) o1; 
-      offset2 = (int16_t) (byte) o2; 
+      offset2 = (int16_t) o2; 
 
       if(x < y) pc = pc+(offset1<<8|offset2) - 3; 
 
@@ -406,8 +490,8 @@ int execute(struct bc0_file *bc0) {
     // 0xA2 if_icmpge <o1,o2> S, x:w32, y:w32 -> S (pc = pc+(o1<<8|o2) if x >= y)
     case IF_ICMPGE:
       pc++; 
-      y = val2int(c0v_pop(S)); 
-      x = val2int(c0v_pop(S)); 
+      y = val2int(POP()); 
+      x = val2int(POP()); 
 
       o1 = P[pc]; 
       pc++; 
@@ -415,7 +499,7 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       offset1 = (int16_t) (byte) o1; 
-      offset2 = (int16_t) (byte) o2; 
+      offset2 = (int16_t) o2; 
 
       if(x >= y) pc = pc+(offset1<<8|offset2) - 3; 
 
@@ -424,8 +508,8 @@ int execute(struct bc0_file *bc0) {
     // 0xA3 if_icmpgt <o1,o2> S, x:w32, y:w32 -> S (pc = pc+(o1<<8|o2) if x > y)  
     case IF_ICMPGT:
       pc++; 
-      y = val2int(c0v_pop(S)); 
-      x = val2int(c0v_pop(S)); 
+      y = val2int(POP()); 
+      x = val2int(POP()); 
 
       o1 = P[pc]; 
       pc++; 
@@ -433,7 +517,7 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       offset1 = (int16_t) (byte) o1; 
-      offset2 = (int16_t) (byte) o2; 
+      offset2 = (int16_t) o2; 
 
       if(x > y) pc = pc+(offset1<<8|offset2) - 3; 
 
@@ -442,8 +526,8 @@ int execute(struct bc0_file *bc0) {
     // 0xA4 if_icmple <o1,o2> S, x:w32, y:w32 -> S (pc = pc+(o1<<8|o2) if x <= y)  
     case IF_ICMPLE: 
       pc++; 
-      y = val2int(c0v_pop(S)); 
-      x = val2int(c0v_pop(S)); 
+      y = val2int(POP()); 
+      x = val2int(POP()); 
 
       o1 = P[pc]; 
       pc++; 
@@ -451,7 +535,7 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       offset1 = (int16_t) (byte) o1; 
-      offset2 = (int16_t) (byte) o2; 
+      offset2 = (int16_t) o2; 
 
       if(x <= y) pc = pc+(offset1<<8|offset2) - 3; 
       break; 
@@ -472,8 +556,6 @@ int execute(struct bc0_file *bc0) {
 
     /* Function call operations: */
 
-    c0_value* temp; 
-
     case INVOKESTATIC:
       pc++; 
       c1 = P[pc]; 
@@ -483,39 +565,67 @@ int execute(struct bc0_file *bc0) {
 
       // information of the function being called upon 
       struct function_info* fi = &bc0->function_pool[c1<<8|c2]; 
-      // Construct a temporary variable array for future use 
-      temp = xcalloc(sizeof(c0_value), fi->num_vars);
-      for(size_t i = 0; i < fi->num_args; i++)
-      {
-        temp[fi->num_args-i-1] = c0v_pop(S);
+
+      if (fi->int_only && all_ints(sp - fi->num_args, fi->num_args)) {
+        // The whole call runs in execute_int(), with unboxed values
+        int32_t result = execute_int(bc0, fi, sp - fi->num_args);
+        sp -= fi->num_args;
+        PUSH(int2val(result));
+        break;
       }
 
-      // /* call stack frames */
-      // typedef struct frame_info frame;
-      // struct frame_info {
-      //   c0v_stack_t S;   /* Operand stack of C0 values */
-      //   ubyte *P;        /* Function body */
-      //   size_t pc;       /* Program counter */
-      //   c0_value *V;     /* The local variables */
-      // };
-
-      // Initialize a new caller frame to be pushed into caller stack 
-      frame* callerframe = xmalloc(sizeof(frame)); 
-      callerframe->S = S; 
+      // Suspend the caller; its stack keeps everything below the arguments
+      frame* callerframe = callstack_push(callStack); 
       callerframe->P = P; 
       callerframe->pc = pc; 
       callerframe->V = V; 
-      push(callStack, (stack_elem) callerframe); 
+      callerframe->S = S; 
 
-      // Initialize the new function call 
-      S = c0v_stack_new(); 
+      // Initialize the new function call; the arguments on top of the
+      // stack become its first locals, and running out of room is caught
+      // by the guard at the end of the call stack
+      V = sp - fi->num_args; 
+      for (size_t i = fi->num_args; i < fi->num_vars; i++) V[i] = int2val(0);
+      S = V + fi->num_vars; 
+      sp = S; 
       P = fi->code; 
       pc = 0; 
-      V = temp; 
 
       break; 
 
 
+    case INVOKETAIL: {
+      // invokestatic directly followed by return (see lib/c0vm_loader.c):
+      // the callee takes over the current frame instead of pushing one
+      pc++; 
+      c1 = P[pc]; 
+      pc++; 
+      c2 = P[pc]; 
+      pc++; 
+
+      struct function_info* callee = &bc0->function_pool[c1<<8|c2]; 
+
+      if (callee->int_only && all_ints(sp - callee->num_args, callee->num_args)) {
+        // The return that follows passes the result on
+        int32_t result = execute_int(bc0, callee, sp - callee->num_args);
+        sp -= callee->num_args;
+        PUSH(int2val(result));
+        break;
+      }
+
+      // Move the arguments down to the start of the locals 
+      c0_value* args = sp - callee->num_args; 
+      for (size_t i = 0; i < callee->num_args; i++) V[i] = args[i]; 
+      for (size_t i = callee->num_args; i < callee->num_vars; i++) V[i] = int2val(0);
+      S = V + callee->num_vars; 
+      sp = S; 
+      P = callee->code; 
+      pc = 0; 
+
+      break; 
+    }
+
+
     case INVOKENATIVE:
       pc++; 
       c1 = P[pc]; 
@@ -525,23 +635,162 @@ int execute(struct bc0_file *bc0) {
 
       // information of the native function being called upon 
       struct native_info* ni = &bc0->native_pool[c1<<8|c2]; 
-      // Construct a temporary variable array for future use 
-      temp = xcalloc(sizeof(c0_value), ni->num_args);
-      for(size_t i = 0; i < ni->num_args; i++)
-      {
-        ASSERT(ni->num_args-i-1 < ni->num_args);
-        temp[ni->num_args-i-1] = c0v_pop(S);
+      // The arguments are already in order on top of the operand stack,
+      // so the native reads them there; the result replaces them
+      sp -= ni->num_args;
+      // Natives take strings as char*, never as VM strings, and dubs
+      // boxed
+      for (size_t i = 0; i < ni->num_args; i++) {
+        flatten_value(&sp[i]);
+        box_dub(&sp[i], V, sp + ni->num_args);
       }
 
-      // Keep the native function 
-      native_fn* fn = native_function_table[ni->function_table_index]; 
+      // Resolved by the loader
+      native_fn* fn = ni->fn; 
+#ifdef IMPLICIT_NULL_CHECKS
+      c0vm_fault_site.P = NULL; // faults in native code are not ours
+#endif
       // Get the result of the native function 
-      c0_value result = (*fn)(temp); 
-      c0v_push(S, result); // Push the result back to the c0 value stack
+      c0_value result = (*fn)(sp); 
+      PUSH(result); // Push the result back to the c0 value stack
 
       break; 
 
 
+    /* Intrinsics (quickened invokenative, see lib/c0vm_loader.c): the
+     * arguments are replaced by the result, and arguments the native
+     * would reject go to the native itself */
+
+    case INVOKE_STRING_LENGTH: {
+      void *s = val2ptr(sp[-1]);
+      sp -= 1;
+      c0_value r = s == NULL ? native_fallback(bc0, P, pc, sp)
+                 : is_vmstring(s) ? int2val((int32_t)string_length_vm(s))
+                 : int2val((int32_t)simd_length(s));
+      PUSH(r);
+      pc += 3;
+      break;
+    }
+
+    case INVOKE_STRING_CHARAT: {
+      void *s = val2ptr(sp[-2]);
+      int32_t i = val2int(sp[-1]);
+      sp -= 2;
+      c0_value r = s != NULL && 0 <= i && (size_t)i < string_length_vm(s)
+                   ? int2val(string_span(s)[i])
+                   : native_fallback(bc0, P, pc, sp);
+      PUSH(r);
+      pc += 3;
+      break;
+    }
+
+    case INVOKE_CHAR_ORD:
+      // A char is already its code
+      sp[-1] = int2val(val2int(sp[-1]));
+      pc += 3;
+      break;
+
+    case INVOKE_CHAR_CHR: {
+      int32_t n = val2int(sp[-1]);
+      sp -= 1;
+      c0_value r = 0 <= n && n < 128 ? int2val(n)
+                                     : native_fallback(bc0, P, pc, sp);
+      PUSH(r);
+      pc += 3;
+      break;
+    }
+
+    case INVOKE_STRING_EQUAL: {
+      void *s = val2ptr(sp[-2]);
+      void *t = val2ptr(sp[-1]);
+      sp -= 2;
+      c0_value r;
+      string_equal_calls++;
+      if (s == t || (is_interned(s) && is_interned(t))) {
+        // Different interned strings are never equal
+        string_equal_fast++;
+        r = int2val(s == t);
+      } else if (s != NULL && t != NULL && !is_vmstring(s)
+                 && !is_vmstring(t)) {
+        char *u = s;
+        char *v = t;
+        size_t i = simd_diff(u, v);
+        r = int2val(u[i] == v[i]);
+      } else if (s != NULL && t != NULL) {
+        // A view does not end in '\0'
+        size_t n = string_length_vm(s);
+        r = int2val(n == string_length_vm(t)
+                    && memcmp(string_span(s), string_span(t), n) == 0);
+      } else {
+        r = native_fallback(bc0, P, pc, sp);
+      }
+      PUSH(r);
+      pc += 3;
+      break;
+    }
+
+    case INVOKE_STRING_SUB: {
+      void *s = val2ptr(sp[-3]);
+      int32_t i = val2int(sp[-2]);
+      int32_t j = val2int(sp[-1]);
+      sp -= 3;
+      c0_value r = s != NULL && 0 <= i && i <= j
+                   && (size_t)j <= string_length_vm(s)
+                   ? ptr2val(string_sub_vm(s, (size_t)i, (size_t)j))
+                   : native_fallback(bc0, P, pc, sp);
+      PUSH(r);
+      pc += 3;
+      break;
+    }
+
+    case INVOKE_STRING_JOIN: {
+      void *s = val2ptr(sp[-2]);
+      void *t = val2ptr(sp[-1]);
+      sp -= 2;
+      c0_value r = s != NULL && t != NULL ? ptr2val(string_join_vm(s, t))
+                                          : native_fallback(bc0, P, pc, sp);
+      PUSH(r);
+      pc += 3;
+      break;
+    }
+
+
+    /* The dub and fpt intrinsics: doubles stay unboxed, and a float is
+     * an int holding its bits */
+
+    case INVOKE_DADD: DUB_OP(dbl2val(lhs + rhs)); break;
+    case INVOKE_DSUB: DUB_OP(dbl2val(lhs - rhs)); break;
+    case INVOKE_DMUL: DUB_OP(dbl2val(lhs * rhs)); break;
+    case INVOKE_DDIV: DUB_OP(dbl2val(lhs / rhs)); break;
+    case INVOKE_DLESS: DUB_OP(int2val(lhs < rhs)); break;
+
+    case INVOKE_DTOI:
+      sp[-1] = int2val((int32_t)val2dbl(sp[-1]));
+      pc += 3;
+      break;
+
+    case INVOKE_ITOD:
+      sp[-1] = dbl2val((double)val2int(sp[-1]));
+      pc += 3;
+      break;
+
+    case INVOKE_FADD: FPT_OP(int2val(float2fpt(lhs + rhs))); break;
+    case INVOKE_FSUB: FPT_OP(int2val(float2fpt(lhs - rhs))); break;
+    case INVOKE_FMUL: FPT_OP(int2val(float2fpt(lhs * rhs))); break;
+    case INVOKE_FDIV: FPT_OP(int2val(float2fpt(lhs / rhs))); break;
+    case INVOKE_FLESS: FPT_OP(int2val(lhs < rhs)); break;
+
+    case INVOKE_FTOI:
+      sp[-1] = int2val((int32_t)fpt2float(val2int(sp[-1])));
+      pc += 3;
+      break;
+
+    case INVOKE_ITOF:
+      sp[-1] = int2val(float2fpt((float)val2int(sp[-1])));
+      pc += 3;
+      break;
+
+
     /* Memory allocation and access operations: */
 
     size_t size; 
@@ -552,27 +801,27 @@ int execute(struct bc0_file *bc0) {
       pc++; 
 
       ptr = xcalloc(1, size); 
-      c0v_push(S, ptr2val(ptr));
+      PUSH(ptr2val(ptr));
 
       break; 
 
     case IMLOAD:
       pc++; 
 
-      ptr = val2ptr(c0v_pop(S)); // Get the integer from opprand stack 
-      if(ptr == NULL) c0_memory_error("Memory error"); 
+      ptr = val2ptr(POP()); // Get the integer from opprand stack 
+      CHECK_NULL(ptr); 
 
       x = *(int*) ptr; 
-      c0v_push(S, int2val(x));
+      PUSH(int2val(x));
 
       break; 
 
     case IMSTORE:
       pc++; 
 
-      x = val2int(c0v_pop(S)); 
-      ptr = val2ptr(c0v_pop(S)); 
-      if(ptr == NULL) c0_memory_error("Memory error");
+      x = val2int(POP()); 
+      ptr = val2ptr(POP()); 
+      CHECK_NULL(ptr);
 
       *(int*)ptr = x; // Modify memory 
 
@@ -582,10 +831,10 @@ int execute(struct bc0_file *bc0) {
     case AMLOAD: {
       pc++; 
 
-      void** A = val2ptr(c0v_pop(S)); 
-      if(A == NULL) c0_memory_error("Memory error");;
+      void** A = val2ptr(POP()); 
+      CHECK_NULL(A);
       void* B = *A; 
-      c0v_push(S, ptr2val(B));
+      PUSH(ptr2val(B));
 
       break; 
     
@@ -594,9 +843,10 @@ int execute(struct bc0_file *bc0) {
     case AMSTORE: {
       pc++; 
 
-      void* B = val2ptr(c0v_pop(S)); 
-      void** A = val2ptr(c0v_pop(S)); 
-      if(A == NULL) c0_memory_error("Memory error");
+      box_dub(&sp[-1], V, sp);
+      void* B = val2ptr(POP()); 
+      void** A = val2ptr(POP()); 
+      CHECK_NULL(A);
       *A = B; 
 
       break; 
@@ -606,10 +856,10 @@ int execute(struct bc0_file *bc0) {
     case CMLOAD: {
       pc++; 
 
-      void* A = val2ptr(c0v_pop(S));
-      if(A == NULL) c0_memory_error("Memory error"); 
+      void* A = val2ptr(POP());
+      CHECK_NULL(A); 
       x = (int)(*(byte*)A); // Has to explicit cast 
-      c0v_push(S, int2val(x));
+      PUSH(int2val(x));
 
       break; 
 
@@ -618,9 +868,9 @@ int execute(struct bc0_file *bc0) {
     case CMSTORE: {
       pc++; 
 
-      x = val2int(c0v_pop(S));
-      void* A = val2ptr(c0v_pop(S));
-      if(A == NULL) c0_memory_error("Memory error"); 
+      x = val2int(POP());
+      void* A = val2ptr(POP());
+      CHECK_NULL(A); 
 
       *(byte*)A = x & 0x7f; 
 
@@ -632,10 +882,10 @@ int execute(struct bc0_file *bc0) {
       ubyte f = P[pc]; // Field offset value, unsigned one byte
       pc++; 
 
-      void* A = val2ptr(c0v_pop(S)); 
+      void* A = val2ptr(POP()); 
       char* new_ptr = (char*)A + f; 
 
-      c0v_push(S, ptr2val((void*)new_ptr));
+      PUSH(ptr2val((void*)new_ptr));
 
       break; 
 
@@ -649,9 +899,9 @@ int execute(struct bc0_file *bc0) {
       int s = (int)(byte)P[pc]; // Number of bytes of each element in array
       pc++; 
 
-      int n = val2int(c0v_pop(S)); // Number of elements in the array 
+      int n = val2int(POP()); // Number of elements in the array 
 
-      if(n == 0) c0v_push(S, ptr2val((void*) NULL)); // NULL pointer if length 0
+      if(n == 0) PUSH(ptr2val((void*) NULL)); // NULL pointer if length 0
       else if(n < 0) c0_memory_error("Invalid array length"); 
       else {
         // Allocate the array in C heap 
@@ -664,7 +914,7 @@ int execute(struct bc0_file *bc0) {
         c0arr->elems = (void*) arr; 
 
         // Push pointer to c0 array struct back to stack
-        c0v_push(S, ptr2val((void*) c0arr)); 
+        PUSH(ptr2val((void*) c0arr)); 
 
       }
 
@@ -675,14 +925,14 @@ int execute(struct bc0_file *bc0) {
     case ARRAYLENGTH: {
       pc++; 
 
-      void* A = val2ptr(c0v_pop(S));
+      void* A = val2ptr(POP());
       c0_array* c0arr = (c0_array*) A; // Obtain pointer to c0 array struct 
 
       int n; 
       if(c0arr == NULL) n = 0; // NULL pointer represents array of length 0
       else              n = c0arr->count; // Length/size of the array 
       
-      c0v_push(S, int2val(n));
+      PUSH(int2val(n));
 
       break; 
 
@@ -692,8 +942,8 @@ int execute(struct bc0_file *bc0) {
     case AADDS: {
       pc++; 
 
-      int i = val2int(c0v_pop(S)); 
-      c0_array* A = (c0_array*) val2ptr(c0v_pop(S));
+      int i = val2int(POP()); 
+      c0_array* A = (c0_array*) val2ptr(POP());
 
       // Check validity of array struct pointer 
       if(A == NULL) c0_memory_error("Accessing array of length 0");
@@ -701,26 +951,273 @@ int execute(struct bc0_file *bc0) {
 
       int s = A->elt_size; // size of each element 
       char* pointer = ((char*)A->elems) + s*i; 
-      c0v_push(S, ptr2val((void*)pointer)); 
+      PUSH(ptr2val((void*)pointer)); 
 
       break; 
 
     }
 
 
+    /* Whole fill and copy loops (lib/c0vm_loops.c), done only if no
+     * iteration would fail */
+
+    case ARRAY_FILL: {
+      int s = P[pc+1];
+      int32_t v = val2int(sp[-1]);
+      int32_t n = val2int(sp[-2]);
+      int32_t i = val2int(sp[-3]);
+      c0_array *A = val2ptr(sp[-4]);
+      sp -= 4;
+      bool done = A != NULL && A->elt_size == s
+                  && 0 <= i && i < n && n <= A->count;
+      if (done && s == 1) {
+        memset((char *)A->elems + i, v & 0x7f, (size_t)(n - i));
+      } else if (done) {
+        int *E = A->elems;
+        for (int32_t k = i; k < n; k++) E[k] = v;
+      }
+      PUSH(int2val(done));
+      pc += 2;
+      break;
+    }
+
+    case ARRAY_COPY: {
+      int s = P[pc+1];
+      int32_t n = val2int(sp[-1]);
+      int32_t i = val2int(sp[-2]);
+      c0_array *A = val2ptr(sp[-3]);
+      c0_array *B = val2ptr(sp[-4]);
+      sp -= 4;
+      bool done = A != NULL && B != NULL
+                  && A->elt_size == s && B->elt_size == s
+                  && 0 <= i && i < n && n <= A->count && n <= B->count;
+      if (done && s == 1) {
+        // As cmstore would; A and B are the same array or disjoint
+        char *src = A->elems, *dst = B->elems;
+        for (int32_t k = i; k < n; k++) dst[k] = src[k] & 0x7f;
+      } else if (done) {
+        memmove((int *)B->elems + i, (int *)A->elems + i,
+                (size_t)(n - i) * sizeof(int));
+      }
+      PUSH(int2val(done));
+      pc += 2;
+      break;
+    }
+
+    case VECTOR_LOOP:
+      vector_run((uint16_t)(P[pc+1] << 8 | P[pc+2]), V);
+      pc += 3;
+      break;
+
+
+    /* Register forms, produced at load time (lib/c0vm_regs.c) */
+
+    case VMOVE:
+      V[P[pc+1]] = V[P[pc+2]];
+      pc += 3;
+      break;
+
+    case VSET:
+      V[P[pc+1]] = int2val((byte)P[pc+2]);
+      pc += 3;
+      break;
+
+    case IADD_VV: case IADD_VI:
+      REG_RESULT((int)((unsigned int)REG_X() + (unsigned int)REG_Y()));
+      break;
+
+    case ISUB_VV: case ISUB_VI:
+      REG_RESULT((int)((unsigned int)REG_X() - (unsigned int)REG_Y()));
+      break;
+
+    case IMUL_VV: case IMUL_VI:
+      REG_RESULT((int)((unsigned int)REG_X() * (unsigned int)REG_Y()));
+      break;
+
+    case IDIV_VV: case IDIV_VI:
+      x = REG_X();
+      y = REG_Y();
+      if (y == 0 || (x == INT_MIN && y == -1))
+        c0_arith_error("Division by 0 error");
+      REG_RESULT(x / y);
+      break;
+
+    case IREM_VV: case IREM_VI:
+      x = REG_X();
+      y = REG_Y();
+      if (y == 0 || (x == INT_MIN && y == -1))
+        c0_arith_error("Division by 0 error");
+      REG_RESULT(x % y);
+      break;
+
+    case IAND_VV: case IAND_VI:
+      REG_RESULT(REG_X() & REG_Y());
+      break;
+
+    case IOR_VV: case IOR_VI:
+      REG_RESULT(REG_X() | REG_Y());
+      break;
+
+    case IXOR_VV: case IXOR_VI:
+      REG_RESULT(REG_X() ^ REG_Y());
+      break;
+
+    case ISHL_VV: case ISHL_VI:
+      x = REG_X();
+      y = REG_Y();
+      if (!(0 <= y && y <= 31)) c0_arith_error("Shift by invalid numbe of bits");
+      REG_RESULT(x << y);
+      break;
+
+    case ISHR_VV: case ISHR_VI:
+      x = REG_X();
+      y = REG_Y();
+      if (!(0 <= y && y <= 31)) c0_arith_error("Shift by invalid numbe of bits");
+      REG_RESULT(x >> y);
+      break;
+
+    case IF_CMPEQ_VV:
+      REG_BRANCH(val_equal(V[P[pc+1]], V[P[pc+2]]));
+      break;
+
+    case IF_CMPNE_VV:
+      REG_BRANCH(!val_equal(V[P[pc+1]], V[P[pc+2]]));
+      break;
+
+    case IF_CMPEQ_VI:
+      REG_BRANCH(val_equal(V[P[pc+1]], int2val((byte)P[pc+2])));
+      break;
+
+    case IF_CMPNE_VI:
+      REG_BRANCH(!val_equal(V[P[pc+1]], int2val((byte)P[pc+2])));
+      break;
+
+    case IF_ICMPLT_VV:
+      REG_BRANCH(val2int(V[P[pc+1]]) < val2int(V[P[pc+2]]));
+      break;
+
+    case IF_ICMPGE_VV:
+      REG_BRANCH(val2int(V[P[pc+1]]) >= val2int(V[P[pc+2]]));
+      break;
+
+    case IF_ICMPGT_VV:
+      REG_BRANCH(val2int(V[P[pc+1]]) > val2int(V[P[pc+2]]));
+      break;
+
+    case IF_ICMPLE_VV:
+      REG_BRANCH(val2int(V[P[pc+1]]) <= val2int(V[P[pc+2]]));
+      break;
+
+    case IF_ICMPLT_VI:
+      REG_BRANCH(val2int(V[P[pc+1]]) < (byte)P[pc+2]);
+      break;
+
+    case IF_ICMPGE_VI:
+      REG_BRANCH(val2int(V[P[pc+1]]) >= (byte)P[pc+2]);
+      break;
+
+    case IF_ICMPGT_VI:
+      REG_BRANCH(val2int(V[P[pc+1]]) > (byte)P[pc+2]);
+      break;
+
+    case IF_ICMPLE_VI:
+      REG_BRANCH(val2int(V[P[pc+1]]) <= (byte)P[pc+2]);
+      break;
+
+
     /* BONUS -- C1 operations */
 
-    case CHECKTAG:
+    case CHECKTAG: {
+      uint16_t tag = (uint16_t)(P[pc+1] << 8 | P[pc+2]);
+      c0_tagged_ptr t = val2tagged_ptr(POP());
+      if (t.p != NULL && t.tag != tag)
+        c0_memory_error("Untagging pointer with incorrect tag");
+      PUSH(ptr2val(t.p));
+      pc += 3;
+      break;
+    }
 
-    case HASTAG:
+    case HASTAG: {
+      uint16_t tag = (uint16_t)(P[pc+1] << 8 | P[pc+2]);
+      c0_tagged_ptr t = val2tagged_ptr(POP());
+      PUSH(int2val(t.p == NULL || t.tag == tag));
+      pc += 3;
+      break;
+    }
 
-    case ADDTAG:
+    case ADDTAG: {
+      uint16_t tag = (uint16_t)(P[pc+1] << 8 | P[pc+2]);
+      box_dub(&sp[-1], V, sp);
+      ptr = val2ptr(POP());
+      PUSH(tagged_ptr2val(ptr, tag));
+      pc += 3;
+      break;
+    }
 
     case ADDROF_STATIC:
-
     case ADDROF_NATIVE:
+      // The index was checked against its pool by the verifier
+      ptr = create_funptr(P[pc] == ADDROF_NATIVE,
+                          (uint16_t)(P[pc+1] << 8 | P[pc+2]));
+      PUSH(ptr2val(ptr));
+      pc += 3;
+      break;
 
     case INVOKEDYNAMIC:
+    case INVOKEDYNAMIC_CACHED: {
+      // A site without a cache of its own (see lib/c0vm_dynamic.c)
+      // resolves its function pointer every time
+      struct call_site uncached = { NULL, NULL, NULL };
+      struct call_site *site = &uncached;
+      if (P[pc] == INVOKEDYNAMIC_CACHED) {
+        site = &call_sites[P[pc+1] << 8 | P[pc+2]];
+        pc += 3;
+      } else {
+        pc++;
+      }
+
+      ptr = val2ptr(POP());
+      if (ptr == NULL || ptr != site->target)
+        resolve_call_site(bc0, site, ptr);
+
+      if (site->ni != NULL) {
+        // As invokenative
+        ni = site->ni;
+        sp -= ni->num_args;
+        for (size_t i = 0; i < ni->num_args; i++) {
+          flatten_value(&sp[i]);
+          box_dub(&sp[i], V, sp + ni->num_args);
+        }
+        fn = ni->fn;
+#ifdef IMPLICIT_NULL_CHECKS
+        c0vm_fault_site.P = NULL;
+#endif
+        result = (*fn)(sp);
+        PUSH(result);
+        break;
+      }
+
+      // As invokestatic
+      fi = site->fi;
+      if (fi->int_only && all_ints(sp - fi->num_args, fi->num_args)) {
+        int32_t r = execute_int(bc0, fi, sp - fi->num_args);
+        sp -= fi->num_args;
+        PUSH(int2val(r));
+        break;
+      }
+      callerframe = callstack_push(callStack);
+      callerframe->P = P;
+      callerframe->pc = pc;
+      callerframe->V = V;
+      callerframe->S = S;
+      V = sp - fi->num_args;
+      for (size_t i = fi->num_args; i < fi->num_vars; i++) V[i] = int2val(0);
+      S = V + fi->num_vars;
+      sp = S;
+      P = fi->code;
+      pc = 0;
+      break;
+    }
 
     default:
       fprintf(stderr, "invalid opcode: 0x%02x\n", P[pc]);
@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <alloca.h>
 #include "lib/c0vm.h"
+#include "lib/c0vm_loader.h"
 
 /* for the args library */
 int c0_argc;
@@ -89,6 +90,9 @@ int main(int argc, char **argv) {
   free(bc0->string_pool);
     bc0->string_pool = stack_allocate_string_pool;
 
+  // Check the code and prepare it for execute()
+  load_program(bc0);
+
   if (filename == NULL) {
     int result = execute(bc0);
     printf("%d\n", result);
@@ -121,13 +121,17 @@ void c0_value_print(c0_value v) {
   case C0_POINTER: {
     void *p = v.payload.p;
     if (is_taggedptr(p)) {
-      c0_tagged_ptr* tp = unmark_tagged_ptr(p);
-      printf("TAGGED POINTER to %p with tag %u", tp->p, tp->tag);
+      c0_tagged_ptr tp = val2tagged_ptr(v);
+      printf("TAGGED POINTER to %p with tag %u", tp.p, tp.tag);
     }
     else
       printf("NORMAL POINTER %p", p);
     break;
   }
+  case C0_DOUBLE: {
+    printf("DOUBLE %g", v.payload.d);
+    break;
+  }
   }
 }
 
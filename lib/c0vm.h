@@ -15,6 +15,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include "xalloc.h"
 #include "contracts.h"
@@ -55,11 +56,18 @@ struct function_info {
   uint8_t num_vars;
   uint16_t code_length;
   ubyte *code;            // \length(code) == code_length
+
+  /* Computed at load time (lib/c0vm_int.c, lib/c0vm_memo.c) */
+  bool int_only;          // runs in execute_int() given int arguments
+  struct memo_table *memo; // result cache, or NULL if not memoized
 };
 
 struct native_info {
   uint16_t num_args;
   uint16_t function_table_index;
+
+  /* Resolved at load time (lib/c0vm_loader.c) */
+  struct c0_value_header (*fn)(struct c0_value_header *args);
 };
 
 
@@ -75,9 +83,10 @@ typedef struct {
   void *elems;    // elements themselves
 } c0_array;
 
-// A 'tagged pointer', aka a void* pointer which knows its original type
+// A 'tagged pointer', aka a void* pointer which knows its original type.
+// Usually encoded in the pointer itself (see tagged_ptr2val()).
 typedef struct {
-  void* p;       // the "real pointer". Cannot be NULL
+  void* p;       // the "real pointer". Only NULL for (void*)NULL
   uint16_t tag;  // types used in casts are mapped to numbers
 } c0_tagged_ptr;
 
@@ -89,11 +98,21 @@ static inline int32_t val2int(c0_value v);
 static inline c0_value ptr2val(void *p);
 static inline void* val2ptr(c0_value v);
 
+// Converting back and forth from doubles (the dub library).  A double
+// stays unboxed in the VM; val2ptr() boxes it when a dub has to be a
+// pointer, and val2dbl() takes either form.
+static inline c0_value dbl2val(double d);
+static inline double val2dbl(c0_value v);
+
+// Floats (the fpt library) are ints holding the bits of a float
+static inline float fpt2float(int32_t x);
+static inline int32_t float2fpt(float f);
+
 // Creates a c0_value with a given pointer and tag
 static inline c0_value tagged_ptr2val(void* p, uint16_t tag);
-// Converts a c0_value to a tagged pointer struct (definition above).
-// May return NULL if the original pointer was NULL e.g. (void*)NULL
-static inline c0_tagged_ptr* val2tagged_ptr(c0_value v);
+// Converts a c0_value to the pointer and tag it holds (struct above).
+// The pointer is NULL if the original pointer was NULL e.g. (void*)NULL
+static inline c0_tagged_ptr val2tagged_ptr(c0_value v);
 
 // Return a function pointer given a pool index and whether it's native or static
 static inline void* create_funptr(bool is_native, uint16_t index);
@@ -111,16 +130,17 @@ static inline bool val_equal(c0_value v1, c0_value v2);
 /*** Implementation and helper functions ***/
 
 // C0 values
-enum c0_val_kind { C0_INTEGER, C0_POINTER };
+enum c0_val_kind { C0_INTEGER, C0_POINTER, C0_DOUBLE };
 
 struct c0_value_header {
   enum c0_val_kind kind;
   union {
     int32_t i;
-    // if ptr & (1L << 63), then
-    // this is actually a pointer to c0_tagged_ptr.
+    // the top bits of a pointer may say that it is a tagged
+    // pointer, a function pointer or a VM string (see ptr_type()).
     // this pointer can be NULL!
     void *p;
+    double d;    // an unboxed dub
   } payload;
 };
 
@@ -150,7 +170,39 @@ static inline void *val2ptr(c0_value v) {
 
   // Note that v may be a tagged pointer or a function pointer as well here.
   // This could happen in AMSTORE
-  return v.payload.p;
+  if (v.kind == C0_POINTER) return v.payload.p;
+
+  // A dub leaving the VM's values, in the library's representation;
+  // execute() keeps the box (box_dub() in c0vm.c)
+  double *box = xmalloc(sizeof(double));
+  *box = v.payload.d;
+  return box;
+}
+
+static inline c0_value dbl2val(double d) {
+  c0_value v;
+  v.kind = C0_DOUBLE;
+  v.payload.d = d;
+  return v;
+}
+
+static inline double val2dbl(c0_value v) {
+  if (v.kind == C0_DOUBLE) return v.payload.d;
+  double *box = val2ptr(v);
+  if (box == NULL) c0_memory_error("Attempting to use a NULL dub");
+  return *box;
+}
+
+static inline float fpt2float(int32_t x) {
+  union { int32_t i; float f; } u;
+  u.i = x;
+  return u.f;
+}
+
+static inline int32_t float2fpt(float f) {
+  union { int32_t i; float f; } u;
+  u.f = f;
+  return u.i;
 }
 
 
@@ -158,8 +210,10 @@ static inline void *val2ptr(c0_value v) {
 #define PTR_TYPE_SHIFT 62
 #define TAGGEDPTR_BITS ((uintptr_t)0x2)
 #define FUNPTR_BITS ((uintptr_t)0x1)
+#define VMSTRING_BITS ((uintptr_t)0x3)    // lib/c0vm_strings.h
 #define TAGGEDPTR_MASK ((uintptr_t)(TAGGEDPTR_BITS << PTR_TYPE_SHIFT))
 #define FUNPTR_MASK ((uintptr_t)(FUNPTR_BITS << PTR_TYPE_SHIFT))
+#define VMSTRING_MASK ((uintptr_t)(VMSTRING_BITS << PTR_TYPE_SHIFT))
 
 // Returns the pointer type
 static inline uintptr_t ptr_type(void *p) {
@@ -174,26 +228,26 @@ static inline bool is_funptr(void *p) {
   return ptr_type(p) == FUNPTR_BITS;
 }
 
-
-// Tagged pointers
-
-// Helper functions for distinguishing between
-// regular pointers and void* tagged pointers.
-// Not useful for c0vm.c
-static inline void *mark_tagged_ptr(c0_tagged_ptr *p) {
-  // NULL does not need to be marked as a tagged pointer
-  // since it has "all" the tags simultaneously
-  REQUIRES(p != NULL);
-  REQUIRES(!is_taggedptr(p));
-
-  return (void*)((uintptr_t)p | TAGGEDPTR_MASK);
+static inline bool is_vmstring(void *p) {
+  return ptr_type(p) == VMSTRING_BITS;
 }
 
-static inline c0_tagged_ptr *unmark_tagged_ptr(void* p) {
-  REQUIRES(p != NULL);
-  REQUIRES(is_taggedptr(p));
 
-  return (c0_tagged_ptr*)((uintptr_t)p ^ TAGGEDPTR_MASK);
+// Tagged pointers
+
+// The tag is kept in the pointer itself, so tagging allocates nothing:
+// below the type bits, bit 61 is set if the target is a function
+// pointer, bits 48..60 hold the tag, and bits 0..47 hold the target
+// (without its own type bits).  User space addresses fit in 48 bits on
+// x86-64 and AArch64.  A tag too large for its field is boxed in a
+// c0_tagged_ptr instead, and the field holds TAG_BOXED.
+#define TAG_SHIFT 48
+#define TAG_BOXED ((uintptr_t)0x1FFF)
+#define TAG_FUNPTR ((uintptr_t)1 << 61)
+#define TARGET_MASK (((uintptr_t)1 << TAG_SHIFT) - 1)
+
+static inline uintptr_t tag_field(void *p) {
+  return ((uintptr_t)p >> TAG_SHIFT) & TAG_BOXED;
 }
 
 static inline c0_value tagged_ptr2val(void *p, uint16_t tag) {
@@ -201,27 +255,51 @@ static inline c0_value tagged_ptr2val(void *p, uint16_t tag) {
     // The NULL pointer must never be tagged
     return ptr2val(NULL);
   }
+  REQUIRES(!is_taggedptr(p) && !is_vmstring(p));
 
-  c0_tagged_ptr *tagged_ptr = xmalloc(sizeof *tagged_ptr);
-  tagged_ptr->p = p;
-  tagged_ptr->tag = tag;
+  uintptr_t target = (uintptr_t)p;
+  uintptr_t fun = 0;
+  if (is_funptr(p)) {
+    target ^= FUNPTR_MASK;
+    fun = TAG_FUNPTR;
+  }
+  uintptr_t field = tag;
+  if (tag >= TAG_BOXED) {
+    c0_tagged_ptr *box = xmalloc(sizeof *box);
+    box->p = p;
+    box->tag = tag;
+    target = (uintptr_t)box;
+    fun = 0;
+    field = TAG_BOXED;
+  }
+  if (target > TARGET_MASK)
+    c0_value_error("tagged_ptr2val: pointer does not fit in 48 bits");
 
-  return ptr2val(mark_tagged_ptr(tagged_ptr));
+  return ptr2val((void*)(TAGGEDPTR_MASK | fun | field << TAG_SHIFT | target));
 }
 
-static inline c0_tagged_ptr* val2tagged_ptr(c0_value v) {
+static inline c0_tagged_ptr val2tagged_ptr(c0_value v) {
   if (v.kind != C0_POINTER)
     c0_value_error("val2tagged_ptr: Invalid cast from c0_value (an integer) to a pointer");
 
   void* p = v.payload.p;
+  c0_tagged_ptr t;
 
   // NULL pointer is never really tagged, but can "act" like one
-  if (p == NULL) return NULL;
+  if (p == NULL) {
+    t.p = NULL;
+    t.tag = 0;
+    return t;
+  }
   if (!is_taggedptr(p))
     c0_value_error("val2tagged_ptr: pointer is not a tagged pointer");
 
-  // Remove 'tag' bit
-  return unmark_tagged_ptr(p);
+  uintptr_t target = (uintptr_t)p & TARGET_MASK;
+  if (tag_field(p) == TAG_BOXED) return *(c0_tagged_ptr*)target;
+  if ((uintptr_t)p & TAG_FUNPTR) target |= FUNPTR_MASK;
+  t.p = (void*)target;
+  t.tag = (uint16_t)tag_field(p);
+  return t;
 }
 
 
@@ -257,6 +335,15 @@ static inline uint16_t funptr2index(void *p) {
 
 // c0_value equality
 static inline bool val_equal(c0_value v1, c0_value v2) {
+  // Unboxed dubs are equal when their bits are, since boxing one boxes
+  // its copies in the frame as well (box_dub() in c0vm.c).  A dub that
+  // has not been boxed yet is neither a boxed dub nor NULL.
+  if (v1.kind == C0_DOUBLE && v2.kind == C0_DOUBLE)
+    return memcmp(&v1.payload.d, &v2.payload.d, sizeof(double)) == 0;
+  if ((v1.kind == C0_DOUBLE && v2.kind == C0_POINTER)
+      || (v1.kind == C0_POINTER && v2.kind == C0_DOUBLE))
+    return false;
+
   // Usually indicates programming bug in c0vm.c
   if (v1.kind != v2.kind) {
     c0_value_error("val_equal: invalid comparison of an int and a pointer");
@@ -280,14 +367,12 @@ static inline bool val_equal(c0_value v1, c0_value v2) {
     // one pointer to be tagged and the other to not be.
     // But VM implementation errors could cause this so it's
     // good to check for this condition anyway
-    c0_tagged_ptr* t1 = unmark_tagged_ptr(p1);
-    c0_tagged_ptr* t2 = unmark_tagged_ptr(p2);
+    c0_tagged_ptr t1 = val2tagged_ptr(v1);
+    c0_tagged_ptr t2 = val2tagged_ptr(v2);
 
-    ASSERT(!is_taggedptr(t1));
-    ASSERT(!is_taggedptr(t2));
-    ASSERT(t1->p != NULL && t2->p != NULL);
+    ASSERT(t1.p != NULL && t2.p != NULL);
 
-    return t1->p == t2->p;
+    return t1.p == t2.p;
   }
 
   if (!is_taggedptr(p1) && !is_taggedptr(p2)) {
@@ -377,14 +462,104 @@ enum instructions {
 
   CHECKTAG = 0xC0,
   HASTAG = 0xC1,
-  ADDTAG = 0xC2
+  ADDTAG = 0xC2,
+
+/* C0VM internal: never in .bc0 files, only produced by the loader */
+  INVOKETAIL = 0xB9,    /* invokestatic <c1,c2> directly followed by return */
+
+/* A whole fill or copy loop over an int[] (s = 4) or char[] (s = 1),
+ * from lib/c0vm_loops.c.  Pushes 1 if it was done, 0 if nothing was
+ * done because some iteration of the loop would fail or none runs. */
+  ARRAY_FILL = 0xC3,    /* <s>  A, i, n, v => done   A[i..n) = v */
+  ARRAY_COPY = 0xC4,    /* <s>  B, A, i, n => done   B[i..n) = A[i..n) */
+
+/* All iterations but the last of the loop that follows, as vector
+ * kernel <k1,k2> from lib/c0vm_vector.c, unless one of them would fail */
+  VECTOR_LOOP = 0xC5,   /* <k1,k2>  => */
+
+/* invokedynamic with the inline cache of call site <c1,c2>, from
+ * lib/c0vm_dynamic.c */
+  INVOKEDYNAMIC_CACHED = 0xC6,
+
+/* Intrinsics: invokenative <c1,c2> of a native the loader recognized,
+ * computed in the interpreter loop itself */
+  INVOKE_STRING_LENGTH = 0xC8,
+  INVOKE_STRING_CHARAT = 0xC9,
+  INVOKE_CHAR_ORD = 0xCA,
+  INVOKE_CHAR_CHR = 0xCB,
+  INVOKE_STRING_EQUAL = 0xCC,
+  INVOKE_STRING_JOIN = 0xCD,
+  INVOKE_STRING_SUB = 0xCE,
+
+/* The dub and fpt natives as arithmetic: the operands of the D forms
+ * are unboxed doubles (or dubs from the library), those of the F forms
+ * ints holding floats */
+  INVOKE_DADD = 0x90,
+  INVOKE_DSUB = 0x91,
+  INVOKE_DMUL = 0x92,
+  INVOKE_DDIV = 0x93,
+  INVOKE_DLESS = 0x94,
+  INVOKE_DTOI = 0x95,
+  INVOKE_ITOD = 0x96,
+  INVOKE_FADD = 0x98,
+  INVOKE_FSUB = 0x99,
+  INVOKE_FMUL = 0x9A,
+  INVOKE_FDIV = 0x9B,
+  INVOKE_FLESS = 0x9C,
+  INVOKE_FTOI = 0x9D,
+  INVOKE_ITOF = 0x9E,
+
+/* Register forms (lib/c0vm_regs.c), operating on locals V[a], V[b]
+ * directly; the _VI forms take a signed byte b instead of V[b], and a
+ * destination d of REG_PUSH pushes the result onto the operand stack */
+  VMOVE = 0xD0,         /* <d,a>     V[d] = V[a] */
+  VSET = 0xD1,          /* <d,b>     V[d] = b */
+
+  IADD_VV = 0xE0,       /* <d,a,b>   V[d] = V[a] + V[b] */
+  ISUB_VV = 0xE1,
+  IMUL_VV = 0xE2,
+  IDIV_VV = 0xE3,
+  IREM_VV = 0xE4,
+  IAND_VV = 0xE5,
+  IOR_VV = 0xE6,
+  IXOR_VV = 0xE7,
+  ISHL_VV = 0xE8,
+  ISHR_VV = 0xE9,
+  IF_CMPEQ_VV = 0xEA,   /* <a,b,o1,o2>  pc = pc+(o1<<8|o2) if V[a] == V[b] */
+  IF_CMPNE_VV = 0xEB,
+  IF_ICMPLT_VV = 0xEC,
+  IF_ICMPGE_VV = 0xED,
+  IF_ICMPGT_VV = 0xEE,
+  IF_ICMPLE_VV = 0xEF,
+
+  IADD_VI = 0xF0,       /* <d,a,b>   V[d] = V[a] + b */
+  ISUB_VI = 0xF1,
+  IMUL_VI = 0xF2,
+  IDIV_VI = 0xF3,
+  IREM_VI = 0xF4,
+  IAND_VI = 0xF5,
+  IOR_VI = 0xF6,
+  IXOR_VI = 0xF7,
+  ISHL_VI = 0xF8,
+  ISHR_VI = 0xF9,
+  IF_CMPEQ_VI = 0xFA,   /* <a,b,o1,o2>  pc = pc+(o1<<8|o2) if V[a] == b */
+  IF_CMPNE_VI = 0xFB,
+  IF_ICMPLT_VI = 0xFC,
+  IF_ICMPGE_VI = 0xFD,
+  IF_ICMPGT_VI = 0xFE,
+  IF_ICMPLE_VI = 0xFF
 };
 
+/* The _VI form of a register opcode is its _VV form plus REG_IMM */
+#define REG_IMM 0x10
+#define REG_PUSH 0xFF
+
 /*** interface functions (used in c0vm-main.c) ***/
 
 struct bc0_file *read_program(char *filename);
 void free_program(struct bc0_file *program);
 
+void load_program(struct bc0_file *bc0);
 int execute(struct bc0_file *bc0);
 
 
@@ -13,30 +13,35 @@
 #include <signal.h>
 
 void c0_user_error(char *err) {
+  fflush(stdout); // the program's output comes before the error
   fprintf(stderr, "User error signaled in C0VM");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   exit(EXIT_FAILURE);
 }
 
 void c0_assertion_failure(char *err) {
+  fflush(stdout);
   fprintf(stderr, "Assertion failure detected in C0VM");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   raise(SIGABRT);
 }
 
 void c0_memory_error(char *err) {
+  fflush(stdout);
   fprintf(stderr, "Memory error detected in C0VM:");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   raise(SIGSEGV);
 }
 
 void c0_value_error(char *err) {
+  fflush(stdout);
   fprintf(stderr, "Incorrect use of c0_value in C0VM:");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   raise(SIGSEGV);
 }
 
 void c0_arith_error(char *err) {
+  fflush(stdout);
   fprintf(stderr, "Division error detected in C0VM");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   raise(SIGFPE);
@@ -0,0 +1,77 @@
+/* C0VM call stack
+ * The regions are reserved with MAP_NORESERVE, so their size only
+ * limits the recursion depth and costs nothing until it is used.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm_callstack.h"
+#include "c0vm_fault.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* Sizes tried first; halved while the system refuses them */
+#define VALUE_REGION ((size_t)16 << 30)
+#define FRAME_REGION ((size_t)4 << 30)
+#define MIN_REGION ((size_t)16 << 20)
+
+/* Larger than any single frame: 255 locals plus an operand stack of at
+ * most 65535 values.  A function whose frame crosses the end of the
+ * region therefore always touches the guard before anything past it. */
+#define GUARD_SIZE ((size_t)2 << 20)
+
+/* Map a region of about size bytes whose last GUARD_SIZE bytes are
+ * inaccessible, and tell the fault handler about the guard */
+void *callstack_region_new(size_t *size) {
+  void *p = MAP_FAILED;
+  while (p == MAP_FAILED && *size >= MIN_REGION) {
+    p = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) *size /= 2;
+  }
+  if (p == MAP_FAILED) {
+    perror("Couldn't reserve the C0VM call stack");
+    exit(EXIT_FAILURE);
+  }
+
+  char *guard = (char*)p + *size - GUARD_SIZE;
+  if (mprotect(guard, GUARD_SIZE, PROT_NONE) != 0) {
+    perror("Couldn't protect the C0VM call stack");
+    exit(EXIT_FAILURE);
+  }
+  c0vm_fault_add_guard(guard, GUARD_SIZE);
+  return p;
+}
+
+callstack_t callstack_new(void) {
+  callstack_t C = xmalloc(sizeof(struct callstack_header));
+  C->frame_bytes = FRAME_REGION;
+  C->frames = callstack_region_new(&C->frame_bytes);
+  C->depth = 0;
+  C->value_bytes = VALUE_REGION;
+  C->values = callstack_region_new(&C->value_bytes);
+
+  ENSURES(C != NULL);
+  return C;
+}
+
+void callstack_region_free(void *region, size_t size) {
+  REQUIRES(region != NULL);
+  c0vm_fault_remove_guard((char*)region + size - GUARD_SIZE);
+  munmap(region, size);
+}
+
+void callstack_free(callstack_t C) {
+  REQUIRES(C != NULL);
+  callstack_region_free(C->frames, C->frame_bytes);
+  callstack_region_free(C->values, C->value_bytes);
+  free(C);
+}
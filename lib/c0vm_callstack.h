@@ -0,0 +1,74 @@
+/* C0VM call stack
+ *
+ * All frames share one contiguous array of c0_values.  A frame is the
+ * callee's local variables followed by its operand stack; the arguments
+ * pushed by the caller already sit where the callee's first locals go.
+ * Frame records for suspended callers live in a second array.
+ *
+ * Both arrays are large reserved regions of virtual memory that are
+ * only backed by pages as deep recursion touches them, and each ends in
+ * an inaccessible guard area.  Running off the end faults, and the
+ * SIGSEGV handler in c0vm_fault.c reports a C0 stack overflow, so calls
+ * never check for room.
+ */
+
+#include <stddef.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_CALLSTACK_H_
+#define _C0VM_CALLSTACK_H_
+
+/* call stack frames */
+typedef struct frame_info frame;
+struct frame_info {
+  ubyte *P;        /* Function body */
+  size_t pc;       /* Program counter */
+  c0_value *V;     /* The local variables */
+  c0_value *S;     /* Operand stack base */
+};
+
+typedef struct callstack_header *callstack_t;
+struct callstack_header {
+  frame *frames;            /* Suspended callers, frames[0..depth) */
+  size_t depth;
+  c0_value *values;         /* Locals and operand stacks of all frames */
+  size_t frame_bytes;       /* Size of each mapping, guard included */
+  size_t value_bytes;
+};
+
+callstack_t callstack_new(void)
+  /*@ensures \result != NULL; @*/ ;
+
+void callstack_free(callstack_t C)
+  /*@requires C != NULL; @*/ ;
+
+/* A region like the ones above, of about *size bytes (updated to the
+ * size actually mapped) including its guard, for stacks of other
+ * element types */
+void *callstack_region_new(size_t *size)
+  /*@ensures \result != NULL; @*/ ;
+
+void callstack_region_free(void *region, size_t size)
+  /*@requires region != NULL; @*/ ;
+
+/* Returns the record for a new suspended caller */
+static inline frame *callstack_push(callstack_t C);
+
+/* Returns the record of the most recently suspended caller */
+static inline frame *callstack_pop(callstack_t C)
+  /*@requires C->depth > 0; @*/ ;
+
+
+/*** Implementation ***/
+
+static inline frame *callstack_push(callstack_t C) {
+  REQUIRES(C != NULL);
+  return &C->frames[C->depth++];
+}
+
+static inline frame *callstack_pop(callstack_t C) {
+  REQUIRES(C != NULL && C->depth > 0);
+  return &C->frames[--C->depth];
+}
+
+#endif /* _C0VM_CALLSTACK_H_ */
@@ -0,0 +1,229 @@
+/* C0VM decoded instructions */
+
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_decode.h"
+#include "c0vm_verify.h"
+
+bool is_branch(ubyte op) {
+  switch (op) {
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+  case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE: case GOTO:
+  case IF_CMPEQ_VV: case IF_CMPNE_VV: case IF_ICMPLT_VV:
+  case IF_ICMPGE_VV: case IF_ICMPGT_VV: case IF_ICMPLE_VV:
+  case IF_CMPEQ_VI: case IF_CMPNE_VI: case IF_ICMPLT_VI:
+  case IF_ICMPGE_VI: case IF_ICMPGT_VI: case IF_ICMPLE_VI:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool is_register_op(ubyte op) {
+  return op == VMOVE || op == VSET || op >= IADD_VV;
+}
+
+code_t code_new(size_t num_args, size_t num_vars) {
+  code_t C = xmalloc(sizeof(struct code_header));
+  C->capacity = 16;
+  C->ins = xcalloc(C->capacity, sizeof(instr));
+  C->len = 0;
+  C->num_args = num_args;
+  C->num_vars = num_vars;
+  return C;
+}
+
+void code_append(code_t C, ubyte op, int32_t arg) {
+  REQUIRES(C != NULL);
+  if (C->len == C->capacity) {
+    instr *ins = xcalloc(2 * C->capacity, sizeof(instr));
+    memcpy(ins, C->ins, C->len * sizeof(instr));
+    free(C->ins);
+    C->ins = ins;
+    C->capacity *= 2;
+  }
+  C->ins[C->len].op = op;
+  C->ins[C->len].arg = arg;
+  C->ins[C->len].a = 0;
+  C->ins[C->len].b = 0;
+  C->len++;
+}
+
+void code_free(code_t C) {
+  REQUIRES(C != NULL);
+  free(C->ins);
+  free(C);
+}
+
+code_t code_decode(struct bc0_file *bc0, size_t f) {
+  REQUIRES(bc0 != NULL && f < bc0->function_count);
+
+  struct function_info *fi = &bc0->function_pool[f];
+  ubyte *P = fi->code;
+  code_t C = code_new(fi->num_args, fi->num_vars);
+
+  // Index of the instruction starting at each pc
+  size_t *index = xcalloc(fi->code_length, sizeof(size_t));
+  for (size_t pc = 0; pc < fi->code_length; pc += instr_length(P[pc])) {
+    ASSERT(instr_length(P[pc]) > 0);
+    index[pc] = C->len;
+
+    if (is_register_op(P[pc])) {
+      code_append(C, P[pc], 0);
+      instr *in = &C->ins[C->len - 1];
+      if (is_branch(P[pc])) {
+        in->a = P[pc+1];
+        in->b = P[pc+2];
+        in->arg = (int32_t)pc + (int16_t)(P[pc+3] << 8 | P[pc+4]);
+      } else if (P[pc] == VSET) {
+        in->arg = P[pc+1];
+        in->b = P[pc+2];
+      } else {
+        in->arg = P[pc+1];
+        in->a = P[pc+2];
+        if (P[pc] != VMOVE) in->b = P[pc+3];
+      }
+      continue;
+    }
+
+    int32_t arg = 0;
+    switch (instr_length(P[pc])) {
+    case 2:
+      arg = P[pc] == BIPUSH ? (int32_t)(byte)P[pc+1] : (int32_t)P[pc+1];
+      break;
+    case 3:
+      arg = (int32_t)(P[pc+1] << 8 | P[pc+2]);
+      if (is_branch(P[pc])) arg = (int32_t)pc + (int16_t)arg;
+      break;
+    }
+    code_append(C, P[pc], arg);
+  }
+
+  // Branch targets from pcs to instruction indices
+  for (size_t i = 0; i < C->len; i++) {
+    if (is_branch(C->ins[i].op)) C->ins[i].arg = (int32_t)index[C->ins[i].arg];
+  }
+
+  free(index);
+  return C;
+}
+
+void code_compact(code_t C) {
+  REQUIRES(C != NULL);
+
+  bool *removed = xcalloc(C->len + 1, sizeof(bool));
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < C->len; i++) {
+      if (removed[i]) continue;
+      if (C->ins[i].op == NOP) {
+        removed[i] = changed = true;
+      } else if (C->ins[i].op == GOTO && (size_t)C->ins[i].arg > i) {
+        size_t t = (size_t)C->ins[i].arg;
+        size_t j = i + 1;
+        while (j < t && removed[j]) j++;
+        if (j == t) removed[i] = changed = true;
+      }
+    }
+  }
+
+  // A removed instruction's index maps to the next remaining one
+  size_t *newindex = xcalloc(C->len + 1, sizeof(size_t));
+  size_t n = 0;
+  for (size_t i = 0; i <= C->len; i++) {
+    newindex[i] = n;
+    if (i < C->len && !removed[i]) n++;
+  }
+
+  for (size_t i = 0; i < C->len; i++) {
+    if (removed[i]) continue;
+    instr in = C->ins[i];
+    if (is_branch(in.op)) in.arg = (int32_t)newindex[in.arg];
+    C->ins[newindex[i]] = in;
+  }
+  C->len = n;
+
+  free(removed);
+  free(newindex);
+}
+
+bool code_encode(code_t C, struct function_info *fi) {
+  REQUIRES(C != NULL && fi != NULL);
+
+  if (C->num_vars > UINT8_MAX) return false;
+
+  // Byte position of every instruction, plus the end
+  size_t *pos = xcalloc(C->len + 1, sizeof(size_t));
+  size_t length = 0;
+  for (size_t i = 0; i < C->len; i++) {
+    pos[i] = length;
+    length += instr_length(C->ins[i].op);
+  }
+  pos[C->len] = length;
+
+  if (length == 0 || length > UINT16_MAX) {
+    free(pos);
+    return false;
+  }
+
+  ubyte *P = xcalloc(length, sizeof(ubyte));
+  for (size_t i = 0; i < C->len; i++) {
+    ubyte op = C->ins[i].op;
+    int32_t arg = C->ins[i].arg;
+    size_t pc = pos[i];
+    P[pc] = op;
+
+    if (is_branch(op)) {
+      long offset = (long)pos[arg] - (long)pc;
+      if (offset < INT16_MIN || offset > INT16_MAX) goto fail;
+      arg = (int32_t)(uint16_t)(int16_t)offset;
+    }
+
+    if (is_register_op(op)) {
+      if (is_branch(op)) {
+        P[pc+1] = C->ins[i].a;
+        P[pc+2] = C->ins[i].b;
+        P[pc+3] = (ubyte)(arg >> 8);
+        P[pc+4] = (ubyte)arg;
+      } else if (op == VSET) {
+        P[pc+1] = (ubyte)arg;
+        P[pc+2] = C->ins[i].b;
+      } else {
+        P[pc+1] = (ubyte)arg;
+        P[pc+2] = C->ins[i].a;
+        if (op != VMOVE) P[pc+3] = C->ins[i].b;
+      }
+      continue;
+    }
+
+    switch (instr_length(op)) {
+    case 2:
+      if (op == BIPUSH ? (arg < INT8_MIN || arg > INT8_MAX)
+                       : (arg < 0 || arg > UINT8_MAX))
+        goto fail;
+      P[pc+1] = (ubyte)arg;
+      break;
+    case 3:
+      if (arg < 0 || arg > UINT16_MAX) goto fail;
+      P[pc+1] = (ubyte)(arg >> 8);
+      P[pc+2] = (ubyte)arg;
+      break;
+    }
+  }
+
+  free(pos);
+  free(fi->code);
+  fi->code = P;
+  fi->code_length = (uint16_t)length;
+  fi->num_vars = (uint8_t)C->num_vars;
+  return true;
+
+ fail:
+  free(pos);
+  free(P);
+  return false;
+}
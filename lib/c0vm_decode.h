@@ -0,0 +1,63 @@
+/* C0VM decoded instructions
+ *
+ * The load-time passes that change the shape of a function's code
+ * (inlining, optimization) work on an array of decoded instructions
+ * rather than on the byte code, so that instructions can be inserted
+ * and removed freely.  Branches refer to the index of their target
+ * instruction; byte offsets are only recomputed by code_encode().
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_DECODE_H_
+#define _C0VM_DECODE_H_
+
+typedef struct instr instr;
+struct instr {
+  ubyte op;
+  int32_t arg;   /* The operand, sign-extended for bipush; for a branch,
+                    the index of the target instruction */
+  ubyte a, b;    /* Source operands of the register forms, whose arg is
+                    the destination (or branch target) */
+};
+
+typedef struct code_header *code_t;
+struct code_header {
+  instr *ins;          /* ins[0..len) */
+  size_t len;
+  size_t capacity;
+  size_t num_args;
+  size_t num_vars;     /* May exceed 255 until code_encode() checks it */
+};
+
+/* Does op branch to the instruction in its arg? */
+bool is_branch(ubyte op);
+
+/* Is op one of the register forms from c0vm.h? */
+bool is_register_op(ubyte op);
+
+/* Decodes function f, which must have passed the verifier */
+code_t code_decode(struct bc0_file *bc0, size_t f)
+  /*@ensures \result != NULL; @*/ ;
+
+code_t code_new(size_t num_args, size_t num_vars)
+  /*@ensures \result != NULL; @*/ ;
+
+void code_append(code_t C, ubyte op, int32_t arg)
+  /*@requires C != NULL; @*/ ;
+
+/* Drops NOPs and gotos to the next instruction, retargeting branches */
+void code_compact(code_t C)
+  /*@requires C != NULL; @*/ ;
+
+/* Replaces fi's code with C.  Returns false, leaving fi unchanged, if
+ * C does not fit the .bc0 limits (code length, branch offsets, local
+ * variable count). */
+bool code_encode(code_t C, struct function_info *fi)
+  /*@requires C != NULL && fi != NULL; @*/ ;
+
+void code_free(code_t C)
+  /*@requires C != NULL; @*/ ;
+
+#endif /* _C0VM_DECODE_H_ */
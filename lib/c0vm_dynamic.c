@@ -0,0 +1,85 @@
+/* C0VM function pointers
+ *
+ * A function pointer is the pool index of a function or a native,
+ * marked by create_funptr(), so a call through one has to check and
+ * decode it first.  Each invokedynamic gets an inline cache instead: the
+ * loader rewrites it into INVOKEDYNAMIC_CACHED <c1,c2>, whose operand
+ * is the index of a call site that remembers the last function pointer
+ * called there and the function it resolved to.  When the same pointer
+ * comes again, as it does at the call of a hash function or a
+ * comparator, the call costs one comparison more than invokestatic.
+ * Another pointer simply replaces the cached one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_abort.h"
+#include "c0vm_decode.h"
+#include "c0vm_dynamic.h"
+#include "c0vm_verify.h"
+
+struct call_site *call_sites = NULL;
+static size_t num_call_sites = 0;
+
+size_t call_site_count(void) {
+  return num_call_sites;
+}
+
+static size_t count_sites(struct function_info *fi) {
+  size_t n = 0;
+  for (size_t pc = 0; pc < fi->code_length; pc += instr_length(fi->code[pc]))
+    if (fi->code[pc] == INVOKEDYNAMIC) n++;
+  return n;
+}
+
+void cache_dynamic_calls(struct bc0_file *bc0, bool report) {
+  REQUIRES(bc0 != NULL);
+
+  size_t sites = 0;
+  for (size_t f = 0; f < bc0->function_count; f++)
+    sites += count_sites(&bc0->function_pool[f]);
+  if (sites == 0) return;
+  if (sites > UINT16_MAX + 1) sites = UINT16_MAX + 1;
+  call_sites = xcalloc(sites, sizeof(struct call_site));
+
+  size_t n = 0;
+  for (size_t f = 0; f < bc0->function_count && n < sites; f++) {
+    if (count_sites(&bc0->function_pool[f]) == 0) continue;
+    code_t C = code_decode(bc0, f);
+    size_t first = n;
+    for (size_t i = 0; i < C->len && n < sites; i++) {
+      if (C->ins[i].op != INVOKEDYNAMIC) continue;
+      C->ins[i].op = INVOKEDYNAMIC_CACHED;
+      C->ins[i].arg = (int32_t)n++;
+    }
+    // Sites of a function that no longer fits keep their plain calls
+    if (!code_encode(C, &bc0->function_pool[f])) n = first;
+    code_free(C);
+  }
+
+  num_call_sites = n;
+  if (report) fprintf(stderr, "dynamic calls: %zu sites cached\n", n);
+}
+
+void resolve_call_site(struct bc0_file *bc0, struct call_site *site,
+                       void *target) {
+  REQUIRES(bc0 != NULL && site != NULL);
+
+  if (target == NULL) c0_memory_error("Calling a NULL function pointer");
+  uint16_t index = funptr2index(target);
+  if (is_native_funptr(target)) {
+    if (index >= bc0->native_count)
+      c0_value_error("invokedynamic: native function out of range");
+    site->fi = NULL;
+    site->ni = &bc0->native_pool[index];
+  } else {
+    if (index >= bc0->function_count)
+      c0_value_error("invokedynamic: function out of range");
+    site->fi = &bc0->function_pool[index];
+    site->ni = NULL;
+  }
+  site->target = target;
+}
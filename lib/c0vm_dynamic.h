@@ -0,0 +1,36 @@
+/* C0VM function pointers
+ * invokedynamic call sites with a monomorphic inline cache
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_DYNAMIC_H_
+#define _C0VM_DYNAMIC_H_
+
+/* What the function pointer last called at a site resolved to */
+struct call_site {
+  void *target;                // that function pointer, or NULL
+  struct function_info *fi;    // its function, or NULL for a native
+  struct native_info *ni;      // its native, or NULL for a function
+};
+
+/* The cached sites, indexed by the operand of INVOKEDYNAMIC_CACHED */
+extern struct call_site *call_sites;
+
+/* The number of cached sites */
+size_t call_site_count(void);
+
+/* Rewrites every invokedynamic into INVOKEDYNAMIC_CACHED, with a call
+ * site of its own.  Must run after the last verify_program().  With
+ * report set, prints the number of sites. */
+void cache_dynamic_calls(struct bc0_file *bc0, bool report)
+  /*@requires bc0 != NULL; @*/ ;
+
+/* Points site at the function target points to, raising an error if
+ * target is NULL or not a valid function pointer */
+void resolve_call_site(struct bc0_file *bc0, struct call_site *site,
+                       void *target)
+  /*@requires bc0 != NULL && site != NULL; @*/ ;
+
+#endif /* _C0VM_DYNAMIC_H_ */
@@ -0,0 +1,120 @@
+/* C0VM fault handling
+ *
+ * Two kinds of faults are expected from a running C0 program:
+ *
+ * - Running off the end of the call stack, which touches one of the
+ *   guard areas set up by c0vm_callstack.c.
+ *
+ * - With IMPLICIT_NULL_CHECKS, the memory opcodes do not compare their
+ *   address against NULL.  Dereferencing NULL (or NULL plus a field
+ *   offset from AADDF, which is at most 255) then touches the first
+ *   page, which is never mapped.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "c0vm.h"
+#include "c0vm_abort.h"
+#include "c0vm_fault.h"
+
+/* Addresses below this are only reached through a NULL pointer */
+#define NULL_PAGE_SIZE 4096
+
+volatile struct fault_site c0vm_fault_site;
+
+static struct bc0_file *fault_program;
+
+/* Guard areas at the end of the call stack regions */
+#define MAX_GUARDS 4
+static struct { char *start; size_t size; } guards[MAX_GUARDS];
+
+void c0vm_fault_add_guard(void *start, size_t size) {
+  for (size_t i = 0; i < MAX_GUARDS; i++) {
+    if (guards[i].start == NULL) {
+      guards[i].start = start;
+      guards[i].size = size;
+      return;
+    }
+  }
+  ASSERT(false); // only the call stacks register guards
+}
+
+void c0vm_fault_remove_guard(void *start) {
+  for (size_t i = 0; i < MAX_GUARDS; i++) {
+    if (guards[i].start == start) guards[i].start = NULL;
+  }
+}
+
+static bool in_guard(char *addr) {
+  for (size_t i = 0; i < MAX_GUARDS; i++) {
+    if (guards[i].start != NULL && guards[i].start <= addr
+        && addr < guards[i].start + guards[i].size)
+      return true;
+  }
+  return false;
+}
+
+static const char *opcode_name(ubyte opcode) {
+  switch (opcode) {
+  case IMLOAD: return "imload";
+  case IMSTORE: return "imstore";
+  case AMLOAD: return "amload";
+  case AMSTORE: return "amstore";
+  case CMLOAD: return "cmload";
+  case CMSTORE: return "cmstore";
+  default: return "unknown opcode";
+  }
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *context) {
+  (void) sig;
+  (void) context;
+  ubyte *P = c0vm_fault_site.P;
+
+  // Sent by raise(), from c0_memory_error() and friends: the default
+  // action is already back, so this ends the process as they intend
+  if (info->si_code <= 0) raise(SIGSEGV);
+
+  if (in_guard(info->si_addr)) {
+    c0_memory_error("Stack overflow (recursion too deep)");
+  }
+
+  // Not a NULL dereference by the C0 program either: returning retries
+  // the access with the default action restored (SA_RESETHAND), which
+  // crashes the way it would have without this handler
+  if ((uintptr_t)info->si_addr >= NULL_PAGE_SIZE || P == NULL) return;
+
+  size_t pc = c0vm_fault_site.pc;
+  size_t f;
+  for (f = 0; f < fault_program->function_count; f++) {
+    if (fault_program->function_pool[f].code == P) break;
+  }
+
+  // This process is about to die, so formatting the message here is fine
+  char msg[100];
+  snprintf(msg, sizeof(msg), "%s of NULL in function %zu at pc %zu",
+           opcode_name(P[pc]), f, pc);
+  c0_memory_error(msg);
+}
+
+void c0vm_fault_init(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+
+  fault_program = bc0;
+  c0vm_fault_site.P = NULL;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = &segv_handler;
+  sigemptyset(&sa.sa_mask);
+  // SA_NODEFER lets the raise(SIGSEGV) in c0_memory_error() go through
+  sa.sa_flags = SA_SIGINFO | SA_RESETHAND | SA_NODEFER;
+  if (sigaction(SIGSEGV, &sa, NULL) != 0) {
+    perror("Couldn't install SIGSEGV handler");
+  }
+}
@@ -0,0 +1,32 @@
+/* C0VM fault handling
+ * Turns hardware faults caused by the running C0 program
+ * back into the usual C0VM errors
+ */
+
+#ifndef _C0VM_FAULT_H_
+#define _C0VM_FAULT_H_
+
+#include <stddef.h>
+#include "c0vm.h"
+
+/* The memory instruction currently being executed.  execute() records
+ * P and pc here right before an access that is allowed to fault; P is
+ * reset to NULL whenever control leaves the interpreter (native calls). */
+struct fault_site {
+  ubyte *P;        /* Function body */
+  size_t pc;       /* Offset of the memory opcode within P */
+};
+
+extern volatile struct fault_site c0vm_fault_site;
+
+/* Install the SIGSEGV handler.  Faults in a guard area are reported
+ * with c0_memory_error() as a stack overflow, and faults on the first
+ * page of memory as a NULL access by the opcode and function found in
+ * c0vm_fault_site.  All other faults crash as usual. */
+void c0vm_fault_init(struct bc0_file *bc0);
+
+/* Guard areas at the end of the call stack */
+void c0vm_fault_add_guard(void *start, size_t size);
+void c0vm_fault_remove_guard(void *start);
+
+#endif /* _C0VM_FAULT_H_ */
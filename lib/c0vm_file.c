@@ -0,0 +1,145 @@
+/* C0VM file natives
+ *
+ * file_read() maps the whole file read-only, and file_readline()
+ * returns each line as a view into the mapping (see lib/c0vm_strings.h),
+ * so the mapping is never written to and its pages stay those of the
+ * page cache.  A line is only copied if it is passed to a native, which
+ * needs its '\0'.
+ *
+ * Files that cannot be mapped, such as pipes and files in /proc, are
+ * read into a buffer instead, and their lines are views into that.
+ *
+ * Strings returned by file_readline() stay valid after file_close(),
+ * so mappings are never unmapped.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "xalloc.h"
+#include "c0vm.h"
+#include "c0vm_abort.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_file.h"
+#include "c0vm_strings.h"
+
+struct c0vm_file {
+  char *data;      // the mapping or buffer, or NULL for an empty file
+  size_t size;
+  size_t pos;      // start of the next line
+  bool closed;
+};
+
+static struct c0vm_file *open_file(c0_value v, char *err) {
+  struct c0vm_file *F = val2ptr(v);
+  if (F == NULL || F->closed) c0_user_error(err);
+  return F;
+}
+
+/* Reads what is left of fd into a buffer of its own, for files that
+ * cannot be mapped: pipes, terminals, and files such as those in /proc
+ * whose size is reported as 0.  Returns false if reading fails. */
+static bool read_file(int fd, struct c0vm_file *F) {
+  size_t capacity = 4096;
+  char *data = xmalloc(capacity);
+  size_t size = 0;
+  while (true) {
+    if (size == capacity) {
+      char *bigger = xmalloc(2 * capacity);
+      memcpy(bigger, data, size);
+      free(data);
+      data = bigger;
+      capacity *= 2;
+    }
+    ssize_t n = read(fd, data + size, capacity - size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0) break;
+    if (n < 0) {
+      free(data);
+      return false;
+    }
+    size += (size_t)n;
+  }
+
+  if (size == 0) {
+    free(data);
+    data = NULL;
+  }
+  F->data = data;
+  F->size = size;
+  return true;
+}
+
+static c0_value file_read(c0_value *args) {
+  char *path = val2ptr(args[0]);
+  int fd = open(path == NULL ? "" : path, O_RDONLY);
+  if (fd < 0) return ptr2val(NULL);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return ptr2val(NULL);
+  }
+
+  struct c0vm_file *F = xcalloc(1, sizeof(struct c0vm_file));
+  void *data = MAP_FAILED;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (data != MAP_FAILED) {
+    F->data = data;
+    F->size = (size_t)st.st_size;
+  } else if (!read_file(fd, F)) {
+    close(fd);
+    free(F);
+    return ptr2val(NULL);
+  }
+  close(fd);
+  return ptr2val(F);
+}
+
+static c0_value file_closed(c0_value *args) {
+  struct c0vm_file *F = val2ptr(args[0]);
+  if (F == NULL) c0_user_error("file_closed: NULL file");
+  return int2val(F->closed);
+}
+
+static c0_value file_close(c0_value *args) {
+  struct c0vm_file *F = open_file(args[0], "file_close: file not open");
+  F->closed = true;
+  return int2val(0);
+}
+
+static c0_value file_eof(c0_value *args) {
+  struct c0vm_file *F = open_file(args[0], "file_eof: file not open");
+  return int2val(F->pos == F->size);
+}
+
+static c0_value file_readline(c0_value *args) {
+  struct c0vm_file *F = open_file(args[0], "file_readline: file not open");
+  if (F->pos == F->size) c0_user_error("file_readline: end of file");
+
+  size_t start = F->pos;
+  char *nl = memchr(F->data + start, '\n', F->size - start);
+  size_t end = nl != NULL ? (size_t)(nl - F->data) : F->size;
+  F->pos = nl != NULL ? end + 1 : end;
+  return ptr2val(string_view_vm(F->data, start, end));
+}
+
+native_fn *file_native(uint16_t function_table_index) {
+  switch (function_table_index) {
+  case NATIVE_FILE_READ: return file_read;
+  case NATIVE_FILE_READLINE: return file_readline;
+  case NATIVE_FILE_EOF: return file_eof;
+  case NATIVE_FILE_CLOSE: return file_close;
+  case NATIVE_FILE_CLOSED: return file_closed;
+  default: return NULL;
+  }
+}
@@ -0,0 +1,16 @@
+/* C0VM file natives
+ * The file library, implemented by the VM over memory-mapped files
+ */
+
+#include <stdint.h>
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+
+#ifndef _C0VM_FILE_H_
+#define _C0VM_FILE_H_
+
+/* The VM's own version of native function_table_index if it belongs to
+ * the file library, or NULL */
+native_fn *file_native(uint16_t function_table_index);
+
+#endif /* _C0VM_FILE_H_ */
@@ -0,0 +1,154 @@
+/* C0VM load-time inlining
+ *
+ * A call to an inlinable function g
+ *
+ *     invokestatic g
+ *
+ * becomes
+ *
+ *     vstore base+n-1 ... vstore base+0     (the n arguments)
+ *     <body of g, local k renamed to base+k, return as goto next>
+ *
+ * where base is the caller's original num_vars.  Inlined bodies never
+ * overlap in time, so every call site in a function reuses the same
+ * locals.  cc0 only produces code that assigns a local before reading
+ * it, so g's other locals need not be cleared on entry.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_decode.h"
+#include "c0vm_inline.h"
+#include "c0vm_verify.h"
+
+/* g can be inlined if it is small, makes no calls that could lead back
+ * to the caller, and leaves exactly its result on the operand stack */
+static bool inlinable(struct bc0_file *bc0, size_t g, code_t C,
+                      size_t budget) {
+  struct function_info *fi = &bc0->function_pool[g];
+  if (C->len > budget) return false;
+
+  for (size_t i = 0; i < C->len; i++) {
+    if (C->ins[i].op == INVOKESTATIC || C->ins[i].op == INVOKEDYNAMIC)
+      return false;
+  }
+
+  int *heights = xcalloc(fi->code_length, sizeof(int));
+  bool ok = stack_heights(bc0, g, heights);
+  ubyte *P = fi->code;
+  for (size_t pc = 0; ok && pc < fi->code_length; pc += instr_length(P[pc])) {
+    if (P[pc] == RETURN && heights[pc] != -1 && heights[pc] != 1)
+      ok = false;
+  }
+  free(heights);
+  return ok;
+}
+
+/* The body to inline for the instruction, or NULL */
+static code_t site_body(instr in, code_t *bodies, size_t base) {
+  if (in.op != INVOKESTATIC) return NULL;
+  code_t G = bodies[in.arg];
+  if (G == NULL || base + G->num_vars > UINT8_MAX) return NULL;
+  return G;
+}
+
+/* Returns the number of call sites inlined into f */
+static size_t inline_calls(struct bc0_file *bc0, size_t f,
+                           code_t *bodies, bool report) {
+  code_t C = code_decode(bc0, f);
+  size_t base = C->num_vars;
+
+  // New index of the first instruction emitted for each old one
+  size_t *map = xcalloc(C->len + 1, sizeof(size_t));
+  size_t count = 0;
+  for (size_t i = 0; i < C->len; i++) {
+    code_t G = site_body(C->ins[i], bodies, base);
+    map[i+1] = map[i] + (G == NULL ? 1 : G->num_args + G->len);
+    if (G != NULL) count++;
+  }
+  if (count == 0) {
+    free(map);
+    code_free(C);
+    return 0;
+  }
+
+  code_t D = code_new(C->num_args, C->num_vars);
+  size_t pc = 0;
+  for (size_t i = 0; i < C->len; i++) {
+    instr in = C->ins[i];
+    code_t G = site_body(in, bodies, base);
+
+    if (G == NULL) {
+      if (is_branch(in.op)) in.arg = (int32_t)map[in.arg];
+      code_append(D, in.op, in.arg);
+    } else {
+      for (size_t k = G->num_args; k > 0; k--)
+        code_append(D, VSTORE, (int32_t)(base + k - 1));
+      size_t start = D->len;
+      for (size_t j = 0; j < G->len; j++) {
+        instr gin = G->ins[j];
+        if (gin.op == VLOAD || gin.op == VSTORE) {
+          gin.arg += (int32_t)base;
+        } else if (is_branch(gin.op)) {
+          gin.arg += (int32_t)start;
+        } else if (gin.op == RETURN) {
+          gin.op = GOTO;
+          gin.arg = (int32_t)map[i+1];
+        }
+        code_append(D, gin.op, gin.arg);
+      }
+      if (base + G->num_vars > D->num_vars) D->num_vars = base + G->num_vars;
+      if (report)
+        fprintf(stderr, "inlined function %d into function %zu at pc %zu "
+                "(%zu instructions)\n", in.arg, f, pc, G->len);
+    }
+    pc += instr_length(C->ins[i].op);
+  }
+  ASSERT(D->len == map[C->len]);
+
+  code_compact(D);
+  if (!code_encode(D, &bc0->function_pool[f])) {
+    if (report)
+      fprintf(stderr, "function %zu too large after inlining, "
+              "left unchanged\n", f);
+    count = 0;
+  }
+
+  free(map);
+  code_free(C);
+  code_free(D);
+  return count;
+}
+
+void inline_program(struct bc0_file *bc0, size_t budget, bool report) {
+  REQUIRES(bc0 != NULL);
+  if (budget == 0) return;
+
+  // Decode the candidates first: they make no static calls, so their
+  // bodies are never changed by inlining into other functions
+  code_t *bodies = xcalloc(bc0->function_count, sizeof(code_t));
+  for (size_t g = 0; g < bc0->function_count; g++) {
+    code_t G = code_decode(bc0, g);
+    if (inlinable(bc0, g, G, budget)) {
+      bodies[g] = G;
+    } else {
+      code_free(G);
+    }
+  }
+
+  size_t total = 0;
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    total += inline_calls(bc0, f, bodies, report);
+  }
+  if (report)
+    fprintf(stderr, "inlined %zu call sites (budget %zu instructions)\n",
+            total, budget);
+
+  for (size_t g = 0; g < bc0->function_count; g++) {
+    if (bodies[g] != NULL) code_free(bodies[g]);
+  }
+  free(bodies);
+}
@@ -0,0 +1,18 @@
+/* C0VM load-time inlining
+ * Splices the bodies of small leaf functions into their callers
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_INLINE_H_
+#define _C0VM_INLINE_H_
+
+/* Inlines every call to a function of at most budget instructions that
+ * makes no static calls itself.  With report set, each inlined call is
+ * listed on stderr.  The program must have passed the verifier and must
+ * not be quickened yet; it needs verify_program() again afterwards. */
+void inline_program(struct bc0_file *bc0, size_t budget, bool report)
+  /*@requires bc0 != NULL; @*/ ;
+
+#endif /* _C0VM_INLINE_H_ */
@@ -0,0 +1,482 @@
+/* C0VM int-only functions
+ *
+ * Every instruction allowed in an int-only function takes ints and
+ * produces ints (the fpt intrinsics included, as a float is an int
+ * holding its bits), locals start out as the int 0, and execute() checks
+ * the arguments before calling execute_int().  So every value in an
+ * int frame is an int by construction, and no instruction here needs
+ * to look at a kind.  The errors are the ones execute() raises.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_callstack.h"
+#include "c0vm_int.h"
+#include "c0vm_memo.h"
+#include "c0vm_verify.h"
+
+static bool int_instruction(ubyte op) {
+  switch (op) {
+  case IADD: case IAND: case IDIV: case IMUL: case IOR:
+  case IREM: case ISHL: case ISHR: case ISUB: case IXOR:
+  case DUP: case POP: case SWAP:
+  case BIPUSH: case ILDC: case VLOAD: case VSTORE:
+  case NOP: case GOTO: case RETURN:
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+  case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE:
+  case INVOKESTATIC: case INVOKETAIL:
+  case INVOKE_FADD: case INVOKE_FSUB: case INVOKE_FMUL: case INVOKE_FDIV:
+  case INVOKE_FLESS: case INVOKE_FTOI: case INVOKE_ITOF:
+    return true;
+  default:
+    // and the register forms
+    return op == VMOVE || op == VSET || op >= IADD_VV;
+  }
+}
+
+static uint16_t callee(ubyte *P, size_t pc) {
+  return (uint16_t)(P[pc+1] << 8 | P[pc+2]);
+}
+
+void mark_int_functions(struct bc0_file *bc0, bool report) {
+  REQUIRES(bc0 != NULL);
+
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    struct function_info *fi = &bc0->function_pool[f];
+    fi->int_only = true;
+    for (size_t pc = 0; pc < fi->code_length; pc += instr_length(fi->code[pc]))
+      if (!int_instruction(fi->code[pc])) fi->int_only = false;
+  }
+
+  // Drop functions that call other functions until none is left; what
+  // remains may call each other recursively
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t f = 0; f < bc0->function_count; f++) {
+      struct function_info *fi = &bc0->function_pool[f];
+      ubyte *P = fi->code;
+      for (size_t pc = 0; fi->int_only && pc < fi->code_length;
+           pc += instr_length(P[pc])) {
+        if ((P[pc] == INVOKESTATIC || P[pc] == INVOKETAIL)
+            && !bc0->function_pool[callee(P, pc)].int_only) {
+          fi->int_only = false;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  if (report) {
+    size_t n = 0;
+    for (size_t f = 0; f < bc0->function_count; f++)
+      if (bc0->function_pool[f].int_only) n++;
+    fprintf(stderr, "int-only functions: %zu of %zu\n",
+            n, (size_t)bc0->function_count);
+  }
+}
+
+
+/*** The int interpreter ***/
+
+typedef struct int_frame_info int_frame;
+struct int_frame_info {
+  ubyte *P;
+  size_t pc;
+  int32_t *V;
+  int32_t *S;
+  struct function_info *fn;
+  int32_t key[MEMO_MAX_ARGS];  // arguments of the callee, if memoized
+};
+
+#define INT_VALUE_REGION ((size_t)4 << 30)
+#define INT_FRAME_REGION ((size_t)4 << 30)
+
+/* Created on the first call and kept until execute_int_done() */
+static int32_t *int_values = NULL;
+static size_t int_value_bytes;
+static int_frame *int_frames = NULL;
+static size_t int_frame_bytes;
+
+void execute_int_done(void) {
+  if (int_values == NULL) return;
+  callstack_region_free(int_values, int_value_bytes);
+  callstack_region_free(int_frames, int_frame_bytes);
+  int_values = NULL;
+  int_frames = NULL;
+}
+
+#define IPUSH(x) (*sp++ = (x))
+#define IPOP() (*--sp)
+#define IBRANCH(cond) \
+  do { pc += (cond) ? (int16_t)(P[pc+1] << 8 | P[pc+2]) : 3; } while (0)
+#define REG_Y() (P[pc] & REG_IMM ? (int32_t)(byte)P[pc+3] : V[P[pc+3]])
+#define REG_RESULT(r) \
+  do { \
+    if (P[pc+1] == REG_PUSH) IPUSH(r); else V[P[pc+1]] = (r); \
+    pc += 4; \
+  } while (0)
+#define REG_BRANCH(cond) \
+  do { pc += (cond) ? (int16_t)(P[pc+3] << 8 | P[pc+4]) : 5; } while (0)
+#define REG_B() (P[pc] & REG_IMM ? (int32_t)(byte)P[pc+2] : V[P[pc+2]])
+
+int32_t execute_int(struct bc0_file *bc0, struct function_info *fi,
+                    c0_value *args) {
+  REQUIRES(bc0 != NULL && fi != NULL && fi->int_only);
+
+  if (int_values == NULL) {
+    int_value_bytes = INT_VALUE_REGION;
+    int_values = callstack_region_new(&int_value_bytes);
+    int_frame_bytes = INT_FRAME_REGION;
+    int_frames = callstack_region_new(&int_frame_bytes);
+  }
+
+  size_t depth = 0;
+  struct function_info *fn = fi;
+  ubyte *P = fi->code;
+  size_t pc = 0;
+  int32_t *V = int_values;
+  for (size_t i = 0; i < fi->num_args; i++) V[i] = val2int(args[i]);
+  int32_t key[MEMO_MAX_ARGS];
+  if (fi->memo != NULL) {
+    int32_t result;
+    if (memo_lookup(fi->memo, V, &result)) return result;
+    for (size_t i = 0; i < fi->num_args; i++) key[i] = V[i];
+  }
+  for (size_t i = fi->num_args; i < fi->num_vars; i++) V[i] = 0;
+  int32_t *S = V + fi->num_vars;
+  int32_t *sp = S;
+
+  int32_t x, y;
+  while (true) {
+
+#ifdef DEBUG
+    fprintf(stderr, "Opcode %x -- Stack size: %zu -- PC: %zu (int)\n",
+            P[pc], (size_t)(sp - S), pc);
+#endif
+
+    switch (P[pc]) {
+
+    case NOP:
+      pc++;
+      break;
+
+    case POP:
+      sp--;
+      pc++;
+      break;
+
+    case DUP:
+      x = sp[-1];
+      IPUSH(x);
+      pc++;
+      break;
+
+    case SWAP:
+      x = sp[-1];
+      sp[-1] = sp[-2];
+      sp[-2] = x;
+      pc++;
+      break;
+
+    case IADD:
+      y = IPOP(); x = IPOP();
+      IPUSH((int32_t)((uint32_t)x + (uint32_t)y));
+      pc++;
+      break;
+
+    case ISUB:
+      y = IPOP(); x = IPOP();
+      IPUSH((int32_t)((uint32_t)x - (uint32_t)y));
+      pc++;
+      break;
+
+    case IMUL:
+      y = IPOP(); x = IPOP();
+      IPUSH((int32_t)((uint32_t)x * (uint32_t)y));
+      pc++;
+      break;
+
+    case IDIV:
+    case IREM:
+      y = IPOP(); x = IPOP();
+      if (y == 0 || (x == INT_MIN && y == -1))
+        c0_arith_error("Division by 0 error");
+      IPUSH(P[pc] == IDIV ? x / y : x % y);
+      pc++;
+      break;
+
+    case IAND:
+      y = IPOP(); x = IPOP();
+      IPUSH(x & y);
+      pc++;
+      break;
+
+    case IOR:
+      y = IPOP(); x = IPOP();
+      IPUSH(x | y);
+      pc++;
+      break;
+
+    case IXOR:
+      y = IPOP(); x = IPOP();
+      IPUSH(x ^ y);
+      pc++;
+      break;
+
+    case ISHL:
+    case ISHR:
+      y = IPOP(); x = IPOP();
+      if (!(0 <= y && y <= 31)) c0_arith_error("Shift by invalid numbe of bits");
+      IPUSH(P[pc] == ISHL ? x << y : x >> y);
+      pc++;
+      break;
+
+    case INVOKE_FADD:
+      y = IPOP(); x = IPOP();
+      IPUSH(float2fpt(fpt2float(x) + fpt2float(y)));
+      pc += 3;
+      break;
+
+    case INVOKE_FSUB:
+      y = IPOP(); x = IPOP();
+      IPUSH(float2fpt(fpt2float(x) - fpt2float(y)));
+      pc += 3;
+      break;
+
+    case INVOKE_FMUL:
+      y = IPOP(); x = IPOP();
+      IPUSH(float2fpt(fpt2float(x) * fpt2float(y)));
+      pc += 3;
+      break;
+
+    case INVOKE_FDIV:
+      y = IPOP(); x = IPOP();
+      IPUSH(float2fpt(fpt2float(x) / fpt2float(y)));
+      pc += 3;
+      break;
+
+    case INVOKE_FLESS:
+      y = IPOP(); x = IPOP();
+      IPUSH(fpt2float(x) < fpt2float(y));
+      pc += 3;
+      break;
+
+    case INVOKE_FTOI:
+      sp[-1] = (int32_t)fpt2float(sp[-1]);
+      pc += 3;
+      break;
+
+    case INVOKE_ITOF:
+      sp[-1] = float2fpt((float)sp[-1]);
+      pc += 3;
+      break;
+
+    case BIPUSH:
+      IPUSH((int32_t)(byte)P[pc+1]);
+      pc += 2;
+      break;
+
+    case ILDC:
+      IPUSH(bc0->int_pool[P[pc+1] << 8 | P[pc+2]]);
+      pc += 3;
+      break;
+
+    case VLOAD:
+      IPUSH(V[P[pc+1]]);
+      pc += 2;
+      break;
+
+    case VSTORE:
+      V[P[pc+1]] = IPOP();
+      pc += 2;
+      break;
+
+    case GOTO:
+      pc += (int16_t)(P[pc+1] << 8 | P[pc+2]);
+      break;
+
+    case IF_CMPEQ:
+      y = IPOP(); x = IPOP();
+      IBRANCH(x == y);
+      break;
+
+    case IF_CMPNE:
+      y = IPOP(); x = IPOP();
+      IBRANCH(x != y);
+      break;
+
+    case IF_ICMPLT:
+      y = IPOP(); x = IPOP();
+      IBRANCH(x < y);
+      break;
+
+    case IF_ICMPGE:
+      y = IPOP(); x = IPOP();
+      IBRANCH(x >= y);
+      break;
+
+    case IF_ICMPGT:
+      y = IPOP(); x = IPOP();
+      IBRANCH(x > y);
+      break;
+
+    case IF_ICMPLE:
+      y = IPOP(); x = IPOP();
+      IBRANCH(x <= y);
+      break;
+
+    case RETURN: {
+      int32_t result = IPOP();
+      if (depth == 0) {
+        if (fn->memo != NULL) memo_store(fn->memo, key, result);
+        return result;
+      }
+      sp = V;
+      int_frame *caller = &int_frames[--depth];
+      if (fn->memo != NULL) memo_store(fn->memo, caller->key, result);
+      fn = caller->fn;
+      P = caller->P;
+      pc = caller->pc;
+      V = caller->V;
+      S = caller->S;
+      IPUSH(result);
+      break;
+    }
+
+    case INVOKETAIL: {
+      struct function_info *g = &bc0->function_pool[callee(P, pc)];
+      // A memoized caller still has to see the result, and a memoized
+      // callee needs a frame to remember its arguments in
+      if (fn->memo == NULL && g->memo == NULL) {
+        int32_t *from = sp - g->num_args;
+        for (size_t i = 0; i < g->num_args; i++) V[i] = from[i];
+        for (size_t i = g->num_args; i < g->num_vars; i++) V[i] = 0;
+        S = V + g->num_vars;
+        sp = S;
+        fn = g;
+        P = g->code;
+        pc = 0;
+        break;
+      }
+    }
+    /* fall through */
+
+    case INVOKESTATIC: {
+      struct function_info *g = &bc0->function_pool[callee(P, pc)];
+      int32_t *from = sp - g->num_args;
+      if (g->memo != NULL) {
+        int32_t result;
+        if (memo_lookup(g->memo, from, &result)) {
+          sp = from;
+          IPUSH(result);
+          pc += 3;
+          break;
+        }
+      }
+      int_frame *caller = &int_frames[depth++];
+      caller->P = P;
+      caller->pc = pc + 3;
+      caller->V = V;
+      caller->S = S;
+      caller->fn = fn;
+      if (g->memo != NULL)
+        for (size_t i = 0; i < g->num_args; i++) caller->key[i] = from[i];
+
+      V = from;
+      for (size_t i = g->num_args; i < g->num_vars; i++) V[i] = 0;
+      S = V + g->num_vars;
+      sp = S;
+      fn = g;
+      P = g->code;
+      pc = 0;
+      break;
+    }
+
+    /* Register forms */
+
+    case VMOVE:
+      V[P[pc+1]] = V[P[pc+2]];
+      pc += 3;
+      break;
+
+    case VSET:
+      V[P[pc+1]] = (int32_t)(byte)P[pc+2];
+      pc += 3;
+      break;
+
+    case IADD_VV: case IADD_VI:
+      REG_RESULT((int32_t)((uint32_t)V[P[pc+2]] + (uint32_t)REG_Y()));
+      break;
+
+    case ISUB_VV: case ISUB_VI:
+      REG_RESULT((int32_t)((uint32_t)V[P[pc+2]] - (uint32_t)REG_Y()));
+      break;
+
+    case IMUL_VV: case IMUL_VI:
+      REG_RESULT((int32_t)((uint32_t)V[P[pc+2]] * (uint32_t)REG_Y()));
+      break;
+
+    case IDIV_VV: case IDIV_VI:
+    case IREM_VV: case IREM_VI:
+      x = V[P[pc+2]];
+      y = REG_Y();
+      if (y == 0 || (x == INT_MIN && y == -1))
+        c0_arith_error("Division by 0 error");
+      REG_RESULT((P[pc] | REG_IMM) == IDIV_VI ? x / y : x % y);
+      break;
+
+    case IAND_VV: case IAND_VI:
+      REG_RESULT(V[P[pc+2]] & REG_Y());
+      break;
+
+    case IOR_VV: case IOR_VI:
+      REG_RESULT(V[P[pc+2]] | REG_Y());
+      break;
+
+    case IXOR_VV: case IXOR_VI:
+      REG_RESULT(V[P[pc+2]] ^ REG_Y());
+      break;
+
+    case ISHL_VV: case ISHL_VI:
+    case ISHR_VV: case ISHR_VI:
+      x = V[P[pc+2]];
+      y = REG_Y();
+      if (!(0 <= y && y <= 31)) c0_arith_error("Shift by invalid numbe of bits");
+      REG_RESULT((P[pc] | REG_IMM) == ISHL_VI ? x << y : x >> y);
+      break;
+
+    case IF_CMPEQ_VV: case IF_CMPEQ_VI:
+      REG_BRANCH(V[P[pc+1]] == REG_B());
+      break;
+
+    case IF_CMPNE_VV: case IF_CMPNE_VI:
+      REG_BRANCH(V[P[pc+1]] != REG_B());
+      break;
+
+    case IF_ICMPLT_VV: case IF_ICMPLT_VI:
+      REG_BRANCH(V[P[pc+1]] < REG_B());
+      break;
+
+    case IF_ICMPGE_VV: case IF_ICMPGE_VI:
+      REG_BRANCH(V[P[pc+1]] >= REG_B());
+      break;
+
+    case IF_ICMPGT_VV: case IF_ICMPGT_VI:
+      REG_BRANCH(V[P[pc+1]] > REG_B());
+      break;
+
+    case IF_ICMPLE_VV: case IF_ICMPLE_VI:
+      REG_BRANCH(V[P[pc+1]] <= REG_B());
+      break;
+
+    default:
+      fprintf(stderr, "invalid opcode in int-only function: 0x%02x\n", P[pc]);
+      abort();
+    }
+  }
+}
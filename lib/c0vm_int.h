@@ -0,0 +1,38 @@
+/* C0VM int-only functions
+ *
+ * A function whose instructions only ever produce ints, and which only
+ * calls other such functions, never needs the kind field of c0_value
+ * once its arguments are known to be ints.  These functions run in a
+ * second interpreter over raw int32_t locals and operand stacks, with
+ * its own call stack; values are only boxed again when the result goes
+ * back to execute().
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_INT_H_
+#define _C0VM_INT_H_
+
+/* Sets int_only for every function of a program that is otherwise
+ * ready to run, and with report set prints how many there are */
+void mark_int_functions(struct bc0_file *bc0, bool report)
+  /*@requires bc0 != NULL; @*/ ;
+
+/* Are args[0..n) all ints, so that an int_only function can take them? */
+static inline bool all_ints(c0_value *args, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (args[i].kind != C0_INTEGER) return false;
+  }
+  return true;
+}
+
+/* Runs fi, which must be int_only, on args[0..fi->num_args) */
+int32_t execute_int(struct bc0_file *bc0, struct function_info *fi,
+                    c0_value *args)
+  /*@requires fi->int_only && all_ints(args, fi->num_args); @*/ ;
+
+/* Releases the int call stack, if execute_int() created one */
+void execute_int_done(void);
+
+#endif /* _C0VM_INT_H_ */
@@ -0,0 +1,171 @@
+/* C0VM input and output
+ *
+ * Printing goes straight into stdout's buffer, without the conversions
+ * of the conio library.  When stdout is a file or a pipe, that buffer
+ * is large and fully buffered, so a program printing millions of lines
+ * makes few write calls; on a terminal, stdout stays line buffered.
+ * Every other native that writes to stdout goes through the same
+ * stream, so output keeps its order.
+ *
+ * Input is read from stdin in large blocks, and readline() returns
+ * the lines as slices of those blocks, with the newline overwritten
+ * by '\0'.  Blocks are never freed, since C0 strings are never freed
+ * either, so everything the program reads from stdin stays resident
+ * until it exits: reading a 1GB input takes 1GB of memory, even if each
+ * line is dropped right away.  Only a line that runs past the end of a
+ * block is copied, to the start of the next one.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "xalloc.h"
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_io.h"
+
+#define OUTPUT_BUFFER_SIZE ((size_t)1 << 20)
+
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+
+void io_init(void) {
+  if (!isatty(STDOUT_FILENO))
+    setvbuf(stdout, output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+}
+
+static void put_string(c0_value v) {
+  char *s = val2ptr(v);
+  if (s != NULL) fputs(s, stdout);
+}
+
+static c0_value io_print(c0_value *args) {
+  put_string(args[0]);
+  return int2val(0);
+}
+
+static c0_value io_println(c0_value *args) {
+  put_string(args[0]);
+  putchar('\n');
+  return int2val(0);
+}
+
+static c0_value io_printint(c0_value *args) {
+  int32_t n = val2int(args[0]);
+  char digits[12];
+  size_t i = sizeof(digits);
+  uint32_t u = n < 0 ? -(uint32_t)n : (uint32_t)n;
+  do {
+    digits[--i] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  if (n < 0) digits[--i] = '-';
+  fwrite(&digits[i], 1, sizeof(digits) - i, stdout);
+  return int2val(0);
+}
+
+static c0_value io_printchar(c0_value *args) {
+  putchar(val2int(args[0]));
+  return int2val(0);
+}
+
+static c0_value io_printbool(c0_value *args) {
+  fputs(val2int(args[0]) ? "true" : "false", stdout);
+  return int2val(0);
+}
+
+static c0_value io_flush(c0_value *args) {
+  (void)args;
+  fflush(stdout);
+  return int2val(0);
+}
+
+
+/*** Input ***/
+
+#define INPUT_BLOCK_SIZE ((size_t)1 << 20)
+
+static char *input = NULL;       // the current block
+static size_t input_size = 0;
+static size_t input_pos = 0;     // start of the unread input
+static size_t input_end = 0;     // end of the input read so far
+static bool input_done = false;  // read() has reported the end
+
+/* Reads more of stdin, after the unread input, which moves to a new
+ * block if the current one is full.  Returns false at end of input. */
+static bool fill_input(void) {
+  if (input_done) return false;
+
+  // One byte is kept free for the '\0' of a last line without newline
+  if (input_end + 1 >= input_size) {
+    size_t unread = input_end - input_pos;
+    size_t size = INPUT_BLOCK_SIZE;
+    while (size < 2 * unread + 1) size *= 2;
+    char *block = xmalloc(size);
+    if (unread > 0) memcpy(block, input + input_pos, unread);
+    input = block;
+    input_size = size;
+    input_pos = 0;
+    input_end = unread;
+  }
+
+  ssize_t n;
+  do {
+    n = read(STDIN_FILENO, input + input_end, input_size - input_end - 1);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    input_done = true;
+    return false;
+  }
+  input_end += (size_t)n;
+  return true;
+}
+
+/* Whatever was printed as a prompt has to show before input is read */
+static c0_value io_readline(c0_value *args) {
+  fflush(stdout);
+  size_t scanned = 0;  // bytes of the line known not to be '\n'
+  while (true) {
+    size_t start = input_pos + scanned;
+    char *nl = start < input_end
+               ? memchr(input + start, '\n', input_end - start) : NULL;
+    if (nl != NULL) {
+      *nl = '\0';
+      char *line = input + input_pos;
+      input_pos = (size_t)(nl - input) + 1;
+      return ptr2val(line);
+    }
+    scanned = input_end - input_pos;
+    if (!fill_input()) break;
+  }
+
+  // The last line has no newline; at the very end, the library decides
+  if (input_pos == input_end) return __c0ffi_readline(args);
+  input[input_end] = '\0';
+  char *line = input + input_pos;
+  input_pos = input_end;
+  return ptr2val(line);
+}
+
+static c0_value io_eof(c0_value *args) {
+  (void)args;
+  fflush(stdout);
+  return int2val(input_pos == input_end && !fill_input());
+}
+
+native_fn *io_native(uint16_t function_table_index) {
+  switch (function_table_index) {
+  case NATIVE_PRINT: return io_print;
+  case NATIVE_PRINTLN: return io_println;
+  case NATIVE_PRINTINT: return io_printint;
+  case NATIVE_PRINTCHAR: return io_printchar;
+  case NATIVE_PRINTBOOL: return io_printbool;
+  case NATIVE_FLUSH: return io_flush;
+  case NATIVE_READLINE: return io_readline;
+  case NATIVE_EOF: return io_eof;
+  default: return NULL;
+  }
+}
@@ -0,0 +1,21 @@
+/* C0VM input and output
+ * The conio natives, implemented by the VM itself
+ */
+
+#include <stdint.h>
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+
+#ifndef _C0VM_IO_H_
+#define _C0VM_IO_H_
+
+/* Gives stdout a large buffer, unless it is a terminal.  The buffer is
+ * only flushed by the flush native, before reading input, at exit, and
+ * by the c0_*_error functions. */
+void io_init(void);
+
+/* The VM's own version of native function_table_index, or NULL if
+ * the library version is used */
+native_fn *io_native(uint16_t function_table_index);
+
+#endif /* _C0VM_IO_H_ */
@@ -0,0 +1,199 @@
+/* C0VM loader
+ *
+ * Once the program is verified, its string literals move into the
+ * string table (lib/c0vm_strings.c), unless C0VM_INTERN is 0; with
+ * C0VM_INTERN=2, strings built by the string natives are interned as
+ * well.  Then the native pool is resolved: every entry gets its
+ * function from native_function_table, or the VM's own version of the
+ * conio, file and (interning) string natives, so that INVOKENATIVE
+ * makes a single lookup, and a table index out of range is an error
+ * here rather than when the call happens.  The bulk string natives
+ * come from lib/c0vm_simd.c, at the level C0VM_SIMD asks for (0 keeps
+ * the library's, 1 is scalar, 2 SSE2, 3 and the default AVX2), or the
+ * highest level below it that the CPU supports.
+ *
+ * Next, small functions are inlined into their callers
+ * (lib/c0vm_inline.c); the budget is the C0VM_INLINE environment
+ * variable, in instructions (0 turns inlining off), and setting
+ * C0VM_REPORT lists what was inlined on stderr.  Then every function
+ * goes through the optimizer (lib/c0vm_optimize.c), unless
+ * C0VM_OPTIMIZE is 0; C0VM_REPORT also prints its instruction counts.
+ *
+ * Once the code is verified for the last time, stack code that only
+ * moves values between locals is translated into the register forms
+ * (lib/c0vm_regs.c), unless C0VM_REGISTERS is 0, and every
+ * invokedynamic gets an inline cache (lib/c0vm_dynamic.c).  Then,
+ * instructions are rewritten in place ("quickened") into internal opcodes wherever
+ * the loader can tell that a cheaper implementation is correct.
+ * Quickening never changes the length of an instruction, so branch
+ * offsets stay valid.  This is also where calls to the hottest string
+ * and char natives become intrinsics, as do the dub and fpt natives,
+ * so that arithmetic on doubles and floats needs neither a native call
+ * nor an allocation.  Last, functions that only compute with ints are
+ * marked to run unboxed (lib/c0vm_int.c), unless C0VM_INT is 0.
+ * Setting C0VM_MEMO to a number of entries gives each of those
+ * functions that takes arguments a result cache that size
+ * (lib/c0vm_memo.c); memoization is off by default.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_dynamic.h"
+#include "c0vm_file.h"
+#include "c0vm_inline.h"
+#include "c0vm_int.h"
+#include "c0vm_io.h"
+#include "c0vm_loader.h"
+#include "c0vm_memo.h"
+#include "c0vm_optimize.h"
+#include "c0vm_regs.h"
+#include "c0vm_simd.h"
+#include "c0vm_strings.h"
+#include "c0vm_verify.h"
+
+#define DEFAULT_INLINE_BUDGET 12
+
+/* A size_t from the environment, or def if the variable is not set */
+static size_t env_size(char *name, size_t def) {
+  char *value = getenv(name);
+  if (value == NULL || *value == '\0') return def;
+  char *end;
+  unsigned long n = strtoul(value, &end, 10);
+  if (*end != '\0') {
+    fprintf(stderr, "Error: $%s must be a number\n", name);
+    exit(EXIT_FAILURE);
+  }
+  return (size_t)n;
+}
+
+/* invokestatic immediately followed by return becomes INVOKETAIL,
+ * which runs the callee in the caller's frame */
+static void quicken_tail_calls(struct function_info *fi) {
+  ubyte *P = fi->code;
+  for (size_t pc = 0; pc < fi->code_length; pc += instr_length(P[pc])) {
+    if (P[pc] == INVOKESTATIC && pc + 3 < fi->code_length
+        && P[pc+3] == RETURN) {
+      P[pc] = INVOKETAIL;
+    }
+  }
+}
+
+static void resolve_natives(struct bc0_file *bc0) {
+  for (size_t i = 0; i < bc0->native_count; i++) {
+    struct native_info *ni = &bc0->native_pool[i];
+    if (ni->function_table_index >= NATIVE_FUNCTION_COUNT) {
+      fprintf(stderr, "Error: native %zu: function table index %u"
+              " out of range\n", i, (unsigned)ni->function_table_index);
+      exit(EXIT_FAILURE);
+    }
+    ni->fn = io_native(ni->function_table_index);
+    if (ni->fn == NULL) ni->fn = file_native(ni->function_table_index);
+    if (ni->fn == NULL) ni->fn = strings_native(ni->function_table_index);
+    if (ni->fn == NULL) ni->fn = simd_native(ni->function_table_index);
+    if (ni->fn == NULL)
+      ni->fn = native_function_table[ni->function_table_index];
+  }
+}
+
+/* The dub and fpt natives the interpreter computes itself */
+static const struct {
+  uint16_t function_table_index;
+  uint16_t num_args;
+  ubyte opcode;
+} arith_intrinsics[] = {
+  { NATIVE_DADD, 2, INVOKE_DADD }, { NATIVE_DSUB, 2, INVOKE_DSUB },
+  { NATIVE_DMUL, 2, INVOKE_DMUL }, { NATIVE_DDIV, 2, INVOKE_DDIV },
+  { NATIVE_DLESS, 2, INVOKE_DLESS }, { NATIVE_DTOI, 1, INVOKE_DTOI },
+  { NATIVE_ITOD, 1, INVOKE_ITOD },
+  { NATIVE_FADD, 2, INVOKE_FADD }, { NATIVE_FSUB, 2, INVOKE_FSUB },
+  { NATIVE_FMUL, 2, INVOKE_FMUL }, { NATIVE_FDIV, 2, INVOKE_FDIV },
+  { NATIVE_FLESS, 2, INVOKE_FLESS }, { NATIVE_FTOI, 1, INVOKE_FTOI },
+  { NATIVE_ITOF, 1, INVOKE_ITOF },
+};
+#define NUM_ARITH_INTRINSICS \
+  (sizeof(arith_intrinsics) / sizeof(arith_intrinsics[0]))
+
+/* invokenative of a native with a VM intrinsic becomes that intrinsic,
+ * keeping the native pool index for its error paths */
+static void quicken_natives(struct bc0_file *bc0, struct function_info *fi) {
+  ubyte *P = fi->code;
+  for (size_t pc = 0; pc < fi->code_length; pc += instr_length(P[pc])) {
+    if (P[pc] != INVOKENATIVE) continue;
+    struct native_info *ni = &bc0->native_pool[P[pc+1] << 8 | P[pc+2]];
+    switch (ni->function_table_index) {
+    case NATIVE_STRING_LENGTH:
+      if (ni->num_args == 1) P[pc] = INVOKE_STRING_LENGTH;
+      break;
+    case NATIVE_STRING_CHARAT:
+      if (ni->num_args == 2) P[pc] = INVOKE_STRING_CHARAT;
+      break;
+    case NATIVE_CHAR_ORD:
+      if (ni->num_args == 1) P[pc] = INVOKE_CHAR_ORD;
+      break;
+    case NATIVE_CHAR_CHR:
+      if (ni->num_args == 1) P[pc] = INVOKE_CHAR_CHR;
+      break;
+    case NATIVE_STRING_EQUAL:
+      if (ni->num_args == 2) P[pc] = INVOKE_STRING_EQUAL;
+      break;
+    case NATIVE_STRING_JOIN:
+      // Unless its results are to be interned
+      if (ni->num_args == 2
+          && ni->fn == native_function_table[NATIVE_STRING_JOIN])
+        P[pc] = INVOKE_STRING_JOIN;
+      break;
+    case NATIVE_STRING_SUB:
+      if (ni->num_args == 3
+          && ni->fn == native_function_table[NATIVE_STRING_SUB])
+        P[pc] = INVOKE_STRING_SUB;
+      break;
+    default:
+      for (size_t i = 0; i < NUM_ARITH_INTRINSICS; i++) {
+        if (arith_intrinsics[i].function_table_index
+              == ni->function_table_index
+            && arith_intrinsics[i].num_args == ni->num_args)
+          P[pc] = arith_intrinsics[i].opcode;
+      }
+      break;
+    }
+  }
+}
+
+void load_program(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+
+  verify_program(bc0);
+
+  char *env = getenv("C0VM_REPORT");
+  bool report = env != NULL && *env != '\0';
+  size_t interning = env_size("C0VM_INTERN", 1);
+  if (interning > 0) intern_program(bc0, interning > 1, report);
+  size_t simd = simd_init(env_size("C0VM_SIMD", SIMD_AVX2));
+  if (report) fprintf(stderr, "string natives: level %zu\n", simd);
+  resolve_natives(bc0);
+
+  size_t budget = env_size("C0VM_INLINE", DEFAULT_INLINE_BUDGET);
+  bool optimize = env_size("C0VM_OPTIMIZE", 1) != 0;
+  if (budget > 0) inline_program(bc0, budget, report);
+  if (optimize) optimize_program(bc0, report);
+  if (budget > 0 || optimize) {
+    // Checks the output of the passes
+    verify_program(bc0);
+  }
+  if (env_size("C0VM_REGISTERS", 1) != 0) translate_registers(bc0, report);
+  cache_dynamic_calls(bc0, report);
+
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    quicken_tail_calls(&bc0->function_pool[f]);
+    quicken_natives(bc0, &bc0->function_pool[f]);
+  }
+  if (env_size("C0VM_INT", 1) != 0) {
+    mark_int_functions(bc0, report);
+    size_t entries = env_size("C0VM_MEMO", 0);
+    if (entries > 0) memo_program(bc0, entries, report);
+  }
+}
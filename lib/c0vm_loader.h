@@ -0,0 +1,16 @@
+/* C0VM loader
+ * Everything that happens to a program between read_program()
+ * and execute()
+ */
+
+#include "c0vm.h"
+
+#ifndef _C0VM_LOADER_H_
+#define _C0VM_LOADER_H_
+
+/* Verifies the program, then rewrites its code in place into the form
+ * execute() runs, which may use the internal opcodes from c0vm.h */
+void load_program(struct bc0_file *bc0)
+  /*@requires bc0 != NULL; @*/ ;
+
+#endif /* _C0VM_LOADER_H_ */
@@ -0,0 +1,508 @@
+/* C0VM loop optimizations
+ *
+ * Loops are found from their back edges: a branch to an earlier
+ * instruction h closes the loop [h, e], where e is the last such
+ * branch.  cc0 only produces structured loops, so only loops that are
+ * entered at h alone are considered; code moved out of a loop goes
+ * into a preheader right before h, which every entry from outside the
+ * loop passes through and no back edge does.
+ *
+ * Hoisting: an expression built only from constants, locals that the
+ * loop never stores to, and operations that cannot fail (arraylength,
+ * aaddf and the non-trapping integer arithmetic) computes the same
+ * value on every iteration.  It is evaluated once in the preheader
+ * into a new local, which the loop loads instead.
+ *
+ * Strength reduction: if the only store to a local i in the loop is
+ * i = i +/- c, then t = i*x for an invariant x can be kept up to date
+ * with t = t +/- c*x right after that store, which is exact in
+ * wrapping arithmetic.  In this interpreter a multiplication costs the
+ * same as an addition, so this only pays when it removes more
+ * instructions than the update adds, i.e. when i*x is used several
+ * times per iteration.
+ *
+ * Idioms: a loop that only fills an int[] or char[] with a value it
+ * never changes, or copies one such array into another,
+ *
+ *     h: vload i; <n>; if_icmpge X      (or if_icmplt B; goto X; B:)
+ *        vload A; vload i; aadds; <v>; imstore
+ *        vload i; bipush 1; iadd; vstore i
+ *        goto h
+ *     X:
+ *
+ * gets a preheader that runs the whole loop as one instruction, which
+ * checks the bounds once:
+ *
+ *        vload A; vload i; <n>; <v>; array_fill 4
+ *        bipush 0; if_cmpeq h
+ *        <n>; vstore i; goto X
+ *
+ * If any iteration would fail (a NULL array, or an index out of
+ * bounds), or none would run, array_fill does nothing and the loop runs
+ * as before, so errors are raised exactly where they were.
+ *
+ * Vector loops: once the code is simplified for the last time, a loop
+ * of the same shape whose body lib/c0vm_vector.c can compile into a
+ * kernel gets the preheader vector_loop <k>, which runs all iterations
+ * but the last at once, or none if any of them could fail.  This comes
+ * last because the kernel reads locals behind the optimizer's back:
+ * a pass that ran afterwards could drop a store to one of them that
+ * the loop itself no longer needs.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_decode.h"
+#include "c0vm_loops.h"
+#include "c0vm_vector.h"
+
+#define MAX_VARS 255
+
+struct loop {
+  size_t head;
+  size_t end;     /* The last back edge */
+};
+
+static bool *branch_targets(code_t C) {
+  bool *targets = xcalloc(C->len + 1, sizeof(bool));
+  for (size_t i = 0; i < C->len; i++) {
+    if (is_branch(C->ins[i].op)) targets[C->ins[i].arg] = true;
+  }
+  return targets;
+}
+
+/* Fills loops with the loops entered only at their head, innermost
+ * (smallest) first, and returns their number */
+static size_t find_loops(code_t C, struct loop *loops) {
+  size_t n = 0;
+  for (size_t i = 0; i < C->len; i++) {
+    if (!is_branch(C->ins[i].op) || (size_t)C->ins[i].arg > i) continue;
+    size_t h = (size_t)C->ins[i].arg;
+    size_t k = 0;
+    while (k < n && loops[k].head != h) k++;
+    if (k == n) loops[n++].head = h;
+    loops[k].end = i;
+  }
+
+  size_t m = 0;
+  for (size_t k = 0; k < n; k++) {
+    struct loop L = loops[k];
+    bool entered_at_head = true;
+    for (size_t i = 0; i < C->len && entered_at_head; i++) {
+      size_t t = (size_t)C->ins[i].arg;
+      if (is_branch(C->ins[i].op) && (i < L.head || i > L.end)
+          && L.head < t && t <= L.end)
+        entered_at_head = false;
+    }
+    if (!entered_at_head) continue;
+
+    // Insertion sort by size
+    size_t j = m++;
+    while (j > 0 && loops[j-1].end - loops[j-1].head > L.end - L.head) {
+      loops[j] = loops[j-1];
+      j--;
+    }
+    loops[j] = L;
+  }
+  return m;
+}
+
+/* Inserts seq[0..n) before instruction at.  Branches to at from within
+ * [lo, hi] still go to the old instruction, all others to seq[0]. */
+static void insert(code_t C, size_t at, instr *seq, size_t n,
+                   size_t lo, size_t hi) {
+  REQUIRES(at <= C->len);
+  instr *ins = xcalloc(C->len + n, sizeof(instr));
+  for (size_t i = 0; i < C->len; i++) {
+    instr in = C->ins[i];
+    if (is_branch(in.op)) {
+      size_t t = (size_t)in.arg;
+      bool from_within = lo <= i && i <= hi;
+      if (t > at || (t == at && from_within)) in.arg += (int32_t)n;
+    }
+    ins[i < at ? i : i + n] = in;
+  }
+  memcpy(&ins[at], seq, n * sizeof(instr));
+
+  free(C->ins);
+  C->ins = ins;
+  C->len += n;
+  C->capacity = C->len;
+}
+
+static void nop(code_t C, size_t i) {
+  C->ins[i].op = NOP;
+  C->ins[i].arg = 0;
+}
+
+/* stores[v] is the number of vstores to v within the loop */
+static size_t *count_stores(code_t C, struct loop L) {
+  size_t *stores = xcalloc(C->num_vars + 1, sizeof(size_t));
+  for (size_t i = L.head; i <= L.end; i++) {
+    if (C->ins[i].op == VSTORE) stores[C->ins[i].arg]++;
+  }
+  return stores;
+}
+
+static bool same_code(instr *a, instr *b, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    if (a[k].op != b[k].op || a[k].arg != b[k].arg) return false;
+  }
+  return true;
+}
+
+struct expr {
+  size_t start, end;
+  size_t temp;
+};
+
+static bool hoist(code_t C, struct loop L, bool *targets) {
+  size_t *stores = count_stores(C, L);
+  size_t h = L.head;
+
+  // start[j-h] is the first instruction of the invariant expression
+  // whose value instruction j pushes, or -1
+  long *start = xcalloc(L.end - h + 1, sizeof(long));
+  for (size_t j = h; j <= L.end; j++) {
+    instr in = C->ins[j];
+    long s = -1;
+    switch (in.op) {
+    case VLOAD:
+      if (stores[in.arg] == 0) s = (long)j;
+      break;
+    case BIPUSH: case ILDC: case ALDC: case ACONST_NULL:
+      s = (long)j;
+      break;
+    case ARRAYLENGTH: case AADDF:
+      if (j > h && !targets[j]) s = start[j-1-h];
+      break;
+    case IADD: case ISUB: case IMUL: case IAND: case IOR: case IXOR: {
+      if (j == h || targets[j]) break;
+      long r = start[j-1-h];
+      if (r > (long)h && !targets[r]) s = start[r-1-(long)h];
+      break;
+    }
+    default:
+      break;
+    }
+    start[j-h] = s;
+  }
+
+  // Maximal expressions of at least two instructions
+  struct expr *exprs = xcalloc(L.end - h + 1, sizeof(struct expr));
+  size_t n = 0;
+  size_t temps = 0;
+  for (long j = (long)L.end; j >= (long)h; ) {
+    long s = start[j-(long)h];
+    if (s < 0 || s == j) {
+      j--;
+      continue;
+    }
+
+    struct expr e = { (size_t)s, (size_t)j, 0 };
+    size_t k = 0;
+    while (k < n && !(exprs[k].end - exprs[k].start == e.end - e.start
+                      && same_code(&C->ins[exprs[k].start], &C->ins[e.start],
+                                   e.end - e.start + 1)))
+      k++;
+    if (k < n) {
+      e.temp = exprs[k].temp;
+    } else if (C->num_vars + temps < MAX_VARS) {
+      e.temp = C->num_vars + temps++;
+    } else {
+      break;
+    }
+    exprs[n++] = e;
+    j = s - 1;
+  }
+
+  if (n > 0) {
+    // Preheader: one evaluation of every distinct expression
+    instr *pre = xcalloc(L.end - h + 1 + temps, sizeof(instr));
+    size_t len = 0;
+    size_t next = C->num_vars;
+    for (size_t k = 0; k < n; k++) {
+      if (exprs[k].temp != next) continue;  // A repeated expression
+      for (size_t i = exprs[k].start; i <= exprs[k].end; i++)
+        pre[len++] = C->ins[i];
+      pre[len].op = VSTORE;
+      pre[len].arg = (int32_t)next;
+      len++;
+      next++;
+    }
+
+    for (size_t k = 0; k < n; k++) {
+      C->ins[exprs[k].start].op = VLOAD;
+      C->ins[exprs[k].start].arg = (int32_t)exprs[k].temp;
+      for (size_t i = exprs[k].start + 1; i <= exprs[k].end; i++) nop(C, i);
+    }
+    C->num_vars += temps;
+    insert(C, h, pre, len, h, L.end);
+    free(pre);
+  }
+
+  free(stores);
+  free(start);
+  free(exprs);
+  return n > 0;
+}
+
+static bool is_const(instr in) {
+  return in.op == BIPUSH || in.op == ILDC;
+}
+
+/* Is x a valid invariant factor for a multiplication by local v? */
+static bool is_factor(instr x, size_t *stores, int32_t v) {
+  return is_const(x) || (x.op == VLOAD && x.arg != v && stores[x.arg] == 0);
+}
+
+/* Does i*x (in either order) end at instruction j+2? */
+static bool is_product(code_t C, bool *targets, size_t j,
+                       int32_t i, instr x) {
+  if (targets[j+1] || targets[j+2] || C->ins[j+2].op != IMUL) return false;
+  instr a = C->ins[j], b = C->ins[j+1];
+  return (a.op == VLOAD && a.arg == i && b.op == x.op && b.arg == x.arg)
+      || (b.op == VLOAD && b.arg == i && a.op == x.op && a.arg == x.arg);
+}
+
+static bool reduce(code_t C, struct loop L, bool *targets) {
+  if (C->num_vars >= MAX_VARS || L.end - L.head < 3) return false;
+  size_t *stores = count_stores(C, L);
+  bool changed = false;
+
+  for (size_t d = L.head + 3; d <= L.end && !changed; d++) {
+    // d: vstore i, the only store to i, of i +/- c
+    instr st = C->ins[d];
+    if (st.op != VSTORE || stores[st.arg] != 1) continue;
+    int32_t i = st.arg;
+    instr c = C->ins[d-2];
+    ubyte step = C->ins[d-1].op;
+    if (C->ins[d-3].op != VLOAD || C->ins[d-3].arg != i || !is_const(c)
+        || (step != IADD && step != ISUB)
+        || targets[d-2] || targets[d-1] || targets[d])
+      continue;
+
+    for (size_t j = L.head; j + 2 <= L.end && !changed; j++) {
+      instr x = C->ins[j].op == VLOAD && C->ins[j].arg == i
+              ? C->ins[j+1] : C->ins[j];
+      if (!is_factor(x, stores, i) || !is_product(C, targets, j, i, x))
+        continue;
+
+      size_t uses = 0;
+      for (size_t k = L.head; k + 2 <= L.end; k++)
+        if (is_product(C, targets, k, i, x)) uses++;
+
+      // The update folds to vload t; bipush c*x; iadd; vstore t unless
+      // x is a local and c is not 1
+      bool unit = c.op == BIPUSH && c.arg == 1;
+      size_t cost = is_const(x) || unit ? 4 : 6;
+      if (2 * uses <= cost) continue;
+
+      int32_t t = (int32_t)C->num_vars++;
+      for (size_t k = L.head; k + 2 <= L.end; k++) {
+        if (!is_product(C, targets, k, i, x)) continue;
+        C->ins[k].op = VLOAD;
+        C->ins[k].arg = t;
+        nop(C, k+1);
+        nop(C, k+2);
+      }
+
+      instr update[6];
+      size_t n = 0;
+      update[n++] = (instr){ VLOAD, t, 0, 0 };
+      update[n++] = x;
+      if (!unit) {
+        update[n++] = c;
+        update[n++] = (instr){ IMUL, 0, 0, 0 };
+      }
+      update[n++] = (instr){ step, 0, 0, 0 };
+      update[n++] = (instr){ VSTORE, t, 0, 0 };
+      insert(C, d + 1, update, n, 0, C->len);
+
+      instr pre[4] = {
+        { VLOAD, i, 0, 0 }, x, { IMUL, 0, 0, 0 }, { VSTORE, t, 0, 0 }
+      };
+      insert(C, L.head, pre, 4, L.head, L.end + n);
+      changed = true;
+    }
+  }
+
+  free(stores);
+  return changed;
+}
+
+/* Does in push a value that a loop whose only store is to i cannot
+ * change? */
+static bool is_invariant_push(instr in, int32_t i) {
+  return is_const(in) || (in.op == VLOAD && in.arg != i);
+}
+
+static bool is_element(instr *I, int32_t i) {
+  return I[0].op == VLOAD && I[0].arg != i
+      && I[1].op == VLOAD && I[1].arg == i && I[2].op == AADDS;
+}
+
+/* Has the loop at h already been given a bulk preheader? */
+static bool is_lowered(code_t C, size_t h) {
+  if (h > 0 && C->ins[h-1].op == VECTOR_LOOP) return true;
+  for (size_t j = 2; j < h; j++) {
+    if (C->ins[j].op == IF_CMPEQ && (size_t)C->ins[j].arg == h
+        && (C->ins[j-2].op == ARRAY_FILL || C->ins[j-2].op == ARRAY_COPY))
+      return true;
+  }
+  return false;
+}
+
+/* A loop counting i up to the invariant n, with a straight-line body
+ * from h+b up to the increment at h+inc, leaving to exit */
+struct counted {
+  int32_t i;
+  instr n;
+  size_t b, inc, exit;
+};
+
+static bool counted_loop(code_t C, struct loop L, bool *targets,
+                         struct counted *out) {
+  size_t h = L.head;
+  size_t len = L.end - h + 1;
+  instr *I = &C->ins[h];
+  if (len < 9 || I[0].op != VLOAD) return false;
+  int32_t i = I[0].arg;
+  instr n = I[1];
+  if (!is_invariant_push(n, i)) return false;
+
+  // The test, with the body from b
+  size_t b, exit;
+  if (I[2].op == IF_ICMPGE) {
+    b = 3;
+    exit = (size_t)I[2].arg;
+  } else if (I[2].op == IF_ICMPLT && (size_t)I[2].arg == h + 4
+             && I[3].op == GOTO) {
+    b = 4;
+    exit = (size_t)I[3].arg;
+  } else {
+    return false;
+  }
+  if (exit != L.end + 1) return false;
+  for (size_t k = 1; k < len; k++)
+    if (targets[h+k] && k != b) return false;
+
+  // The increment and the back edge
+  size_t inc = len - 5;
+  if (inc <= b
+      || !(I[inc].op == VLOAD && I[inc].arg == i
+           && I[inc+1].op == BIPUSH && I[inc+1].arg == 1
+           && I[inc+2].op == IADD
+           && I[inc+3].op == VSTORE && I[inc+3].arg == i
+           && I[inc+4].op == GOTO && (size_t)I[inc+4].arg == h))
+    return false;
+
+  *out = (struct counted){ i, n, b, inc, exit };
+  return true;
+}
+
+static bool lower_idiom(code_t C, struct loop L, bool *targets) {
+  size_t h = L.head;
+  instr *I = &C->ins[h];
+  struct counted K;
+  if (L.end - h + 1 < 12 || !counted_loop(C, L, targets, &K)) return false;
+  int32_t i = K.i;
+  instr n = K.n;
+  size_t b = K.b, inc = K.inc, exit = K.exit;
+
+  ubyte store = I[inc-1].op;
+  if ((store != IMSTORE && store != CMSTORE) || !is_element(&I[b], i))
+    return false;
+  int32_t size = store == IMSTORE ? 4 : 1;
+
+  instr seq[10];
+  size_t k = 0;
+  seq[k++] = I[b];
+  if (inc - b == 5 && is_invariant_push(I[b+3], i)) {
+    seq[k++] = I[b+1];
+    seq[k++] = n;
+    seq[k++] = I[b+3];
+    seq[k++] = (instr){ ARRAY_FILL, size, 0, 0 };
+  } else if (inc - b == 8 && is_element(&I[b+3], i)
+             && I[b+6].op == (store == IMSTORE ? IMLOAD : CMLOAD)) {
+    seq[k++] = I[b+3];
+    seq[k++] = I[b+1];
+    seq[k++] = n;
+    seq[k++] = (instr){ ARRAY_COPY, size, 0, 0 };
+  } else {
+    return false;
+  }
+  if (is_lowered(C, h)) return false;
+
+  // Branches in seq are relative to the code after the insertion
+  size_t m = k + 5;
+  seq[k++] = (instr){ BIPUSH, 0, 0, 0 };
+  seq[k++] = (instr){ IF_CMPEQ, (int32_t)(h + m), 0, 0 };
+  seq[k++] = n;
+  seq[k++] = (instr){ VSTORE, i, 0, 0 };
+  seq[k++] = (instr){ GOTO, (int32_t)(exit + m), 0, 0 };
+  insert(C, h, seq, m, h, L.end);
+  return true;
+}
+
+bool optimize_loops(code_t C) {
+  REQUIRES(C != NULL);
+
+  bool changed = false;
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    struct loop *loops = xcalloc(C->len, sizeof(struct loop));
+    size_t n = find_loops(C, loops);
+    for (size_t k = 0; k < n && !progress; k++) {
+      bool *targets = branch_targets(C);
+      progress = hoist(C, loops[k], targets) || reduce(C, loops[k], targets)
+                 || lower_idiom(C, loops[k], targets);
+      free(targets);
+    }
+    free(loops);
+    if (progress) {
+      code_compact(C);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static bool vectorize(struct bc0_file *bc0, code_t C, struct loop L,
+                      bool *targets) {
+  struct counted K;
+  uint16_t kernel;
+  if (!counted_loop(C, L, targets, &K) || is_lowered(C, L.head)
+      || !vector_compile(bc0, &C->ins[L.head + K.b], K.inc - K.b,
+                         K.i, K.n, &kernel))
+    return false;
+
+  instr seq[1] = { { VECTOR_LOOP, kernel, 0, 0 } };
+  insert(C, L.head, seq, 1, L.head, L.end);
+  return true;
+}
+
+bool vectorize_loops(struct bc0_file *bc0, code_t C) {
+  REQUIRES(bc0 != NULL && C != NULL);
+
+  bool changed = false;
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    struct loop *loops = xcalloc(C->len, sizeof(struct loop));
+    size_t n = find_loops(C, loops);
+    for (size_t k = 0; k < n && !progress; k++) {
+      bool *targets = branch_targets(C);
+      progress = vectorize(bc0, C, loops[k], targets);
+      free(targets);
+    }
+    free(loops);
+    changed = changed || progress;
+  }
+  return changed;
+}
@@ -0,0 +1,26 @@
+/* C0VM loop optimizations
+ * Loop-invariant code motion, strength reduction, fill and copy loops
+ * as single instructions, and element-wise loops as vector kernels
+ */
+
+#include <stdbool.h>
+#include "c0vm_decode.h"
+
+#ifndef _C0VM_LOOPS_H_
+#define _C0VM_LOOPS_H_
+
+/* Moves loop-invariant computations in C out of its loops, turns
+ * multiplications of an induction variable into additions where that
+ * saves instructions, and gives array fill and copy loops a preheader
+ * that runs them as one instruction.  C must have no NOPs, and is left
+ * without any.  Returns true if anything changed. */
+bool optimize_loops(code_t C)
+  /*@requires C != NULL; @*/ ;
+
+/* Gives every loop in C that lib/c0vm_vector.c can run as a kernel a
+ * vector_loop preheader.  No pass may change C afterwards, except to
+ * encode it.  Returns true if anything changed. */
+bool vectorize_loops(struct bc0_file *bc0, code_t C)
+  /*@requires bc0 != NULL && C != NULL; @*/ ;
+
+#endif /* _C0VM_LOOPS_H_ */
@@ -0,0 +1,59 @@
+/* C0VM memoization of pure functions
+ *
+ * Purity is the int_only analysis of lib/c0vm_int.c: it already rules
+ * out NEW, every memory opcode, INVOKENATIVE, INVOKEDYNAMIC and calls
+ * to functions that use any of them.  The lookups and stores happen in
+ * execute_int(), around the calls of memoized functions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_memo.h"
+
+static bool report_memo = false;
+
+void memo_program(struct bc0_file *bc0, size_t entries, bool report) {
+  REQUIRES(bc0 != NULL && entries > 0);
+
+  size_t size = 1;
+  while (size < entries) size *= 2;
+
+  size_t n = 0;
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    struct function_info *fi = &bc0->function_pool[f];
+    if (!fi->int_only || fi->num_args == 0 || fi->num_args > MEMO_MAX_ARGS)
+      continue;
+    struct memo_table *M = xcalloc(1, sizeof(struct memo_table));
+    M->entries = xcalloc(size, sizeof(struct memo_entry));
+    M->mask = size - 1;
+    M->num_args = fi->num_args;
+    fi->memo = M;
+    n++;
+  }
+
+  report_memo = report;
+  if (report) {
+    fprintf(stderr, "memoized functions: %zu of %zu (%zu entries each)\n",
+            n, (size_t)bc0->function_count, size);
+  }
+}
+
+void memo_done(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    struct function_info *fi = &bc0->function_pool[f];
+    struct memo_table *M = fi->memo;
+    if (M == NULL) continue;
+    if (report_memo && M->hits + M->misses > 0) {
+      fprintf(stderr, "memo function %zu: %zu hits, %zu misses\n",
+              f, M->hits, M->misses);
+    }
+    free(M->entries);
+    free(M);
+    fi->memo = NULL;
+  }
+}
@@ -0,0 +1,87 @@
+/* C0VM memoization of pure functions
+ *
+ * With memoization turned on, every int-only function of one to
+ * MEMO_MAX_ARGS arguments gets a result cache.  An int-only function
+ * cannot allocate, touch memory, call natives or call anything that
+ * does (lib/c0vm_int.c), so its result only depends on its arguments.
+ * A call that raises an error never returns, and so never gets cached.
+ *
+ * The cache is direct-mapped with a fixed number of entries per
+ * function: a colliding call simply replaces the older entry.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_MEMO_H_
+#define _C0VM_MEMO_H_
+
+#define MEMO_MAX_ARGS 4
+
+struct memo_entry {
+  bool valid;
+  int32_t args[MEMO_MAX_ARGS];
+  int32_t result;
+};
+
+struct memo_table {
+  struct memo_entry *entries;
+  size_t mask;                 /* Number of entries - 1 */
+  size_t num_args;
+  size_t hits;
+  size_t misses;
+};
+
+/* Gives every memoizable function a cache of about entries entries
+ * (rounded up to a power of 2).  With report set, memo_done() prints
+ * hit and miss counts. */
+void memo_program(struct bc0_file *bc0, size_t entries, bool report)
+  /*@requires bc0 != NULL && entries > 0; @*/ ;
+
+/* Releases the caches, printing their statistics if asked to */
+void memo_done(struct bc0_file *bc0)
+  /*@requires bc0 != NULL; @*/ ;
+
+/* Looks up the call with arguments args[0..M->num_args) */
+static inline bool memo_lookup(struct memo_table *M, int32_t *args,
+                               int32_t *result);
+
+static inline void memo_store(struct memo_table *M, int32_t *args,
+                              int32_t result);
+
+
+/*** Implementation ***/
+
+static inline struct memo_entry *memo_slot(struct memo_table *M,
+                                           int32_t *args) {
+  uint32_t h = 0;
+  for (size_t i = 0; i < M->num_args; i++)
+    h = (h ^ (uint32_t)args[i]) * 0x9E3779B1u;
+  return &M->entries[(h ^ (h >> 16)) & M->mask];
+}
+
+static inline bool memo_lookup(struct memo_table *M, int32_t *args,
+                               int32_t *result) {
+  struct memo_entry *e = memo_slot(M, args);
+  bool hit = e->valid;
+  for (size_t i = 0; hit && i < M->num_args; i++)
+    hit = e->args[i] == args[i];
+  if (hit) {
+    M->hits++;
+    *result = e->result;
+  } else {
+    M->misses++;
+  }
+  return hit;
+}
+
+static inline void memo_store(struct memo_table *M, int32_t *args,
+                              int32_t result) {
+  struct memo_entry *e = memo_slot(M, args);
+  e->valid = true;
+  for (size_t i = 0; i < M->num_args; i++) e->args[i] = args[i];
+  e->result = result;
+}
+
+#endif /* _C0VM_MEMO_H_ */
@@ -0,0 +1,393 @@
+/* C0VM load-time optimizer
+ *
+ * A handful of passes over the decoded form, repeated until none of
+ * them finds anything to do:
+ *
+ *  - unreachable instructions are dropped
+ *  - within a basic block, vload of a local that holds a known constant
+ *    or a copy of another local is replaced by the constant or by a
+ *    vload of the original
+ *  - constant arithmetic and comparisons are folded, along with
+ *    operations by an identity (x+0, x*1, ...) and values that are
+ *    pushed only to be popped again
+ *  - stores to locals that are never read again become pops
+ *
+ * followed by the loop optimizations in lib/c0vm_loops.c, after which
+ * the passes run again to clean up, and last by vector loops.
+ *
+ * Folding follows execute() exactly: arithmetic wraps, and a division
+ * or shift that would raise an arithmetic error is left for run time.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_decode.h"
+#include "c0vm_loops.h"
+#include "c0vm_optimize.h"
+#include "c0vm_vector.h"
+
+#define MAX_VARS 256
+#define WORDS (MAX_VARS / 64)
+
+static bool is_const(instr in) {
+  return in.op == BIPUSH || in.op == ILDC;
+}
+
+static int32_t const_value(struct bc0_file *bc0, instr in) {
+  REQUIRES(is_const(in));
+  return in.op == BIPUSH ? in.arg : bc0->int_pool[in.arg];
+}
+
+/* An instruction pushing x, adding x to the int pool if needed.
+ * Returns false if x needs the pool and the pool is full. */
+static bool make_const(struct bc0_file *bc0, int32_t x, instr *out) {
+  if (INT8_MIN <= x && x <= INT8_MAX) {
+    out->op = BIPUSH;
+    out->arg = x;
+    return true;
+  }
+
+  for (size_t j = 0; j < bc0->int_count; j++) {
+    if (bc0->int_pool[j] == x) {
+      out->op = ILDC;
+      out->arg = (int32_t)j;
+      return true;
+    }
+  }
+  if (bc0->int_count == UINT16_MAX) return false;
+
+  int32_t *pool = xcalloc(bc0->int_count + 1, sizeof(int32_t));
+  if (bc0->int_count > 0)
+    memcpy(pool, bc0->int_pool, bc0->int_count * sizeof(int32_t));
+  free(bc0->int_pool);
+  bc0->int_pool = pool;
+  bc0->int_pool[bc0->int_count] = x;
+  out->op = ILDC;
+  out->arg = (int32_t)bc0->int_count;
+  bc0->int_count++;
+  return true;
+}
+
+/* Does control never continue to the next instruction? */
+static bool ends_block(ubyte op) {
+  return op == GOTO || op == RETURN || op == ATHROW;
+}
+
+/* Instructions that only push a value, with no other effect */
+static bool is_pure_push(ubyte op) {
+  switch (op) {
+  case BIPUSH: case ILDC: case ALDC: case ACONST_NULL: case VLOAD:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* targets[i] is true if some branch goes to instruction i */
+static bool *branch_targets(code_t C) {
+  bool *targets = xcalloc(C->len + 1, sizeof(bool));
+  for (size_t i = 0; i < C->len; i++) {
+    if (is_branch(C->ins[i].op)) targets[C->ins[i].arg] = true;
+  }
+  return targets;
+}
+
+static void nop(code_t C, size_t i) {
+  C->ins[i].op = NOP;
+  C->ins[i].arg = 0;
+}
+
+static bool remove_unreachable(code_t C) {
+  bool *reached = xcalloc(C->len, sizeof(bool));
+  size_t *worklist = xcalloc(C->len, sizeof(size_t));
+  size_t n = 0;
+  reached[0] = true;
+  worklist[n++] = 0;
+
+  while (n > 0) {
+    size_t i = worklist[--n];
+    instr in = C->ins[i];
+    if (is_branch(in.op) && !reached[in.arg]) {
+      reached[in.arg] = true;
+      worklist[n++] = (size_t)in.arg;
+    }
+    if (!ends_block(in.op) && i + 1 < C->len && !reached[i+1]) {
+      reached[i+1] = true;
+      worklist[n++] = i + 1;
+    }
+  }
+
+  bool changed = false;
+  for (size_t i = 0; i < C->len; i++) {
+    if (!reached[i] && C->ins[i].op != NOP) {
+      nop(C, i);
+      changed = true;
+    }
+  }
+  free(reached);
+  free(worklist);
+  return changed;
+}
+
+/* What a local is known to hold within the current basic block */
+enum known { UNKNOWN, CONSTANT, COPY };
+struct fact {
+  enum known known;
+  instr value;        /* The constant instruction, or vload of the copy */
+};
+
+static bool propagate(code_t C) {
+  bool *targets = branch_targets(C);
+  struct fact *facts = xcalloc(C->num_vars, sizeof(struct fact));
+  bool changed = false;
+
+  for (size_t i = 0; i < C->len; i++) {
+    if (targets[i] || (i > 0 && ends_block(C->ins[i-1].op))) {
+      for (size_t v = 0; v < C->num_vars; v++) facts[v].known = UNKNOWN;
+    }
+
+    instr in = C->ins[i];
+    if (in.op == VLOAD && facts[in.arg].known != UNKNOWN) {
+      C->ins[i] = facts[in.arg].value;
+      changed = true;
+    } else if (in.op == VSTORE) {
+      for (size_t v = 0; v < C->num_vars; v++) {
+        if (facts[v].known == COPY && facts[v].value.arg == in.arg)
+          facts[v].known = UNKNOWN;
+      }
+      facts[in.arg].known = UNKNOWN;
+      if (i > 0 && !targets[i]) {
+        instr prev = C->ins[i-1];
+        if (is_const(prev)) {
+          facts[in.arg].known = CONSTANT;
+          facts[in.arg].value = prev;
+        } else if (prev.op == VLOAD && prev.arg != in.arg) {
+          facts[in.arg].known = COPY;
+          facts[in.arg].value = prev;
+        }
+      }
+    }
+  }
+
+  free(targets);
+  free(facts);
+  return changed;
+}
+
+/* Folds x op y, unless execute() would raise an error */
+static bool fold_arith(ubyte op, int32_t x, int32_t y, int32_t *res) {
+  uint32_t ux = (uint32_t)x, uy = (uint32_t)y;
+  switch (op) {
+  case IADD: *res = (int32_t)(ux + uy); return true;
+  case ISUB: *res = (int32_t)(ux - uy); return true;
+  case IMUL: *res = (int32_t)(ux * uy); return true;
+  case IAND: *res = x & y; return true;
+  case IOR:  *res = x | y; return true;
+  case IXOR: *res = x ^ y; return true;
+  case IDIV:
+  case IREM:
+    if (y == 0 || (x == INT32_MIN && y == -1)) return false;
+    *res = op == IDIV ? x / y : x % y;
+    return true;
+  case ISHL:
+  case ISHR:
+    if (!(0 <= y && y <= 31)) return false;
+    *res = op == ISHL ? (int32_t)(ux << y) : x >> y;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool fold_compare(ubyte op, int32_t x, int32_t y, bool *res) {
+  switch (op) {
+  case IF_CMPEQ:  *res = x == y; return true;
+  case IF_CMPNE:  *res = x != y; return true;
+  case IF_ICMPLT: *res = x < y;  return true;
+  case IF_ICMPGE: *res = x >= y; return true;
+  case IF_ICMPGT: *res = x > y;  return true;
+  case IF_ICMPLE: *res = x <= y; return true;
+  default:
+    return false;
+  }
+}
+
+/* Is "push y; op" the same as doing nothing? */
+static bool is_identity(ubyte op, int32_t y) {
+  switch (op) {
+  case IADD: case ISUB: case IOR: case IXOR: case ISHL: case ISHR:
+    return y == 0;
+  case IMUL: case IDIV:
+    return y == 1;
+  case IAND:
+    return y == -1;
+  default:
+    return false;
+  }
+}
+
+/* Only the first instruction of a rewritten window may be a branch
+ * target: a branch to it then skips the whole (equivalent) window */
+static bool peephole(struct bc0_file *bc0, code_t C) {
+  bool *targets = branch_targets(C);
+  bool changed = false;
+
+  for (size_t i = 0; i + 1 < C->len; i++) {
+    instr a = C->ins[i];
+    instr b = C->ins[i+1];
+    if (targets[i+1]) continue;
+
+    if (i + 2 < C->len && !targets[i+2] && is_const(a) && is_const(b)) {
+      instr c = C->ins[i+2];
+      int32_t x = const_value(bc0, a), y = const_value(bc0, b);
+      int32_t res;
+      bool taken;
+      if (fold_arith(c.op, x, y, &res) && make_const(bc0, res, &C->ins[i])) {
+        nop(C, i+1);
+        nop(C, i+2);
+        changed = true;
+        continue;
+      }
+      if (fold_compare(c.op, x, y, &taken)) {
+        nop(C, i);
+        nop(C, i+1);
+        if (taken) C->ins[i+2].op = GOTO; else nop(C, i+2);
+        changed = true;
+        continue;
+      }
+    }
+
+    if (is_const(b) && i + 2 < C->len && !targets[i+2]
+        && is_identity(C->ins[i+2].op, const_value(bc0, b))) {
+      nop(C, i+1);
+      nop(C, i+2);
+      changed = true;
+    } else if ((is_pure_push(a.op) || a.op == DUP) && b.op == POP) {
+      nop(C, i);
+      nop(C, i+1);
+      changed = true;
+    } else if (a.op == VLOAD && b.op == VSTORE && a.arg == b.arg) {
+      nop(C, i);
+      nop(C, i+1);
+      changed = true;
+    }
+  }
+
+  free(targets);
+  return changed;
+}
+
+typedef uint64_t liveset[WORDS];
+
+static bool live_has(uint64_t *s, int32_t v) {
+  return (s[v / 64] >> (v % 64)) & 1;
+}
+
+/* live[i] is the set of locals that may be read after instruction i */
+static uint64_t *live_after(code_t C) {
+  uint64_t *live = xcalloc(C->len * WORDS, sizeof(uint64_t));
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = C->len; i-- > 0; ) {
+      liveset out = {0};
+      instr in = C->ins[i];
+      size_t succ[2];
+      size_t n = 0;
+      if (is_branch(in.op)) succ[n++] = (size_t)in.arg;
+      if (!ends_block(in.op) && i + 1 < C->len) succ[n++] = i + 1;
+
+      for (size_t k = 0; k < n; k++) {
+        // Live before succ = (live after succ - def) + use
+        instr s = C->ins[succ[k]];
+        liveset before;
+        memcpy(before, &live[succ[k] * WORDS], sizeof(liveset));
+        if (s.op == VSTORE)
+          before[s.arg / 64] &= ~((uint64_t)1 << (s.arg % 64));
+        if (s.op == VLOAD)
+          before[s.arg / 64] |= (uint64_t)1 << (s.arg % 64);
+        for (size_t w = 0; w < WORDS; w++) out[w] |= before[w];
+      }
+
+      if (memcmp(out, &live[i * WORDS], sizeof(liveset)) != 0) {
+        memcpy(&live[i * WORDS], out, sizeof(liveset));
+        changed = true;
+      }
+    }
+  }
+  return live;
+}
+
+static bool eliminate_dead_stores(code_t C) {
+  uint64_t *live = live_after(C);
+  bool *targets = branch_targets(C);
+  bool changed = false;
+
+  for (size_t i = 0; i < C->len; i++) {
+    instr in = C->ins[i];
+    if (in.op != VSTORE) continue;
+
+    if (!live_has(&live[i * WORDS], in.arg)) {
+      C->ins[i].op = POP;
+      C->ins[i].arg = 0;
+      changed = true;
+    } else if (i + 1 < C->len && !targets[i+1]
+               && C->ins[i+1].op == VLOAD && C->ins[i+1].arg == in.arg
+               && !live_has(&live[(i+1) * WORDS], in.arg)) {
+      // The value is only needed on the stack
+      nop(C, i);
+      nop(C, i+1);
+      changed = true;
+    }
+  }
+
+  free(live);
+  free(targets);
+  return changed;
+}
+
+/* Runs the passes above until none of them changes anything */
+static void simplify(struct bc0_file *bc0, code_t C) {
+  bool changed = true;
+  while (changed) {
+    changed = remove_unreachable(C);
+    changed = propagate(C) || changed;
+    changed = peephole(bc0, C) || changed;
+    changed = eliminate_dead_stores(C) || changed;
+    code_compact(C);
+  }
+}
+
+void optimize_program(struct bc0_file *bc0, bool report) {
+  REQUIRES(bc0 != NULL);
+
+  size_t total_before = 0, total_after = 0;
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    code_t C = code_decode(bc0, f);
+    ASSERT(C->num_vars <= MAX_VARS);
+    size_t before = C->len;
+
+    simplify(bc0, C);
+    if (optimize_loops(C)) simplify(bc0, C);
+    vectorize_loops(bc0, C);
+
+    size_t after = before;
+    if (code_encode(C, &bc0->function_pool[f]))
+      after = C->len;
+    if (report)
+      fprintf(stderr, "function %zu: %zu -> %zu instructions\n",
+              f, before, after);
+    total_before += before;
+    total_after += after;
+    code_free(C);
+  }
+
+  if (report)
+    fprintf(stderr, "optimized %zu -> %zu instructions, %zu vector loops\n",
+            total_before, total_after, vector_kernel_count());
+}
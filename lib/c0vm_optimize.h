@@ -0,0 +1,19 @@
+/* C0VM load-time optimizer
+ * Shortens the naive stack code cc0 produces
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_OPTIMIZE_H_
+#define _C0VM_OPTIMIZE_H_
+
+/* Rewrites every function into an equivalent sequence of fewer
+ * instructions.  With report set, the instruction count of each
+ * function before and after is printed on stderr.  The program must
+ * have passed the verifier and must not be quickened yet; it needs
+ * verify_program() again afterwards. */
+void optimize_program(struct bc0_file *bc0, bool report)
+  /*@requires bc0 != NULL; @*/ ;
+
+#endif /* _C0VM_OPTIMIZE_H_ */
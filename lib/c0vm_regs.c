@@ -0,0 +1,146 @@
+/* C0VM register forms
+ *
+ * cc0 evaluates every expression on the operand stack, even when its
+ * operands are locals and its result goes straight into a local:
+ *
+ *     vload a; vload b; iadd; vstore d      =>   iadd_vv d, a, b
+ *     vload a; bipush 1; iadd; vstore a     =>   iadd_vi a, a, 1
+ *     vload a; vload b; if_icmplt L         =>   if_icmplt_vv a, b, L
+ *     vload a; vstore d                     =>   vmove d, a
+ *
+ * The operand stack slots in the middle of such a sequence are never
+ * observed by any other instruction, so they become registers that only
+ * exist in the C variables of execute().  A result that stays on the
+ * stack for a larger expression is pushed (destination REG_PUSH).
+ * Everything else keeps running as stack code, in the same function
+ * and the same interpreter loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_decode.h"
+#include "c0vm_regs.h"
+
+/* The _VV register form of a stack opcode, or 0 if there is none */
+static ubyte register_form(ubyte op) {
+  switch (op) {
+  case IADD: return IADD_VV;
+  case ISUB: return ISUB_VV;
+  case IMUL: return IMUL_VV;
+  case IDIV: return IDIV_VV;
+  case IREM: return IREM_VV;
+  case IAND: return IAND_VV;
+  case IOR:  return IOR_VV;
+  case IXOR: return IXOR_VV;
+  case ISHL: return ISHL_VV;
+  case ISHR: return ISHR_VV;
+  case IF_CMPEQ:  return IF_CMPEQ_VV;
+  case IF_CMPNE:  return IF_CMPNE_VV;
+  case IF_ICMPLT: return IF_ICMPLT_VV;
+  case IF_ICMPGE: return IF_ICMPGE_VV;
+  case IF_ICMPGT: return IF_ICMPGT_VV;
+  case IF_ICMPLE: return IF_ICMPLE_VV;
+  default: return 0;
+  }
+}
+
+/* op with its operands swapped: "k op x" as "x op' k" */
+static ubyte swapped(ubyte op) {
+  switch (op) {
+  case IADD: case IMUL: case IAND: case IOR: case IXOR:
+  case IF_CMPEQ: case IF_CMPNE:
+    return op;
+  case IF_ICMPLT: return IF_ICMPGT;
+  case IF_ICMPGT: return IF_ICMPLT;
+  case IF_ICMPLE: return IF_ICMPGE;
+  case IF_ICMPGE: return IF_ICMPLE;
+  default: return 0;
+  }
+}
+
+static void nop(code_t C, size_t i) {
+  C->ins[i].op = NOP;
+  C->ins[i].arg = 0;
+}
+
+/* Rewrites the sequence starting at instruction i, if there is one.
+ * Returns the number of instructions consumed. */
+static size_t translate(code_t C, bool *targets, size_t i) {
+  instr *ins = C->ins;
+  size_t n = C->len - i;
+  if (n < 2 || targets[i+1]) return 1;
+
+  // vload a; vstore d  and  bipush b; vstore d
+  if (ins[i+1].op == VSTORE && (ins[i].op == VLOAD || ins[i].op == BIPUSH)) {
+    instr in = { VMOVE, ins[i+1].arg, (ubyte)ins[i].arg, 0 };
+    if (ins[i].op == BIPUSH) {
+      in.op = VSET;
+      in.a = 0;
+      in.b = (ubyte)ins[i].arg;
+    }
+    ins[i] = in;
+    nop(C, i+1);
+    return 2;
+  }
+
+  if (n < 3 || targets[i+2]) return 1;
+
+  // x; y; op  with a local x and a local or constant y, in either order
+  ubyte op = ins[i+2].op;
+  instr x = ins[i], y = ins[i+1];
+  if (x.op == BIPUSH && y.op == VLOAD && swapped(op) != 0) {
+    x = ins[i+1];
+    y = ins[i];
+    op = swapped(op);
+  }
+  if (x.op != VLOAD || (y.op != VLOAD && y.op != BIPUSH)
+      || register_form(op) == 0)
+    return 1;
+
+  instr in = { register_form(op), 0, (ubyte)x.arg, (ubyte)y.arg };
+  if (y.op == BIPUSH) in.op += REG_IMM;
+  size_t used = 3;
+  if (is_branch(op)) {
+    in.arg = ins[i+2].arg;
+  } else if (n > 3 && !targets[i+3] && ins[i+3].op == VSTORE) {
+    in.arg = ins[i+3].arg;
+    used = 4;
+  } else {
+    in.arg = REG_PUSH;
+  }
+
+  ins[i] = in;
+  for (size_t k = 1; k < used; k++) nop(C, i+k);
+  return used;
+}
+
+void translate_registers(struct bc0_file *bc0, bool report) {
+  REQUIRES(bc0 != NULL);
+
+  size_t total_before = 0, total_after = 0;
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    code_t C = code_decode(bc0, f);
+    size_t before = C->len;
+
+    bool *targets = xcalloc(C->len + 1, sizeof(bool));
+    for (size_t i = 0; i < C->len; i++) {
+      if (is_branch(C->ins[i].op)) targets[C->ins[i].arg] = true;
+    }
+    for (size_t i = 0; i < C->len; ) i += translate(C, targets, i);
+    free(targets);
+
+    code_compact(C);
+    size_t after = before;
+    if (code_encode(C, &bc0->function_pool[f])) after = C->len;
+    total_before += before;
+    total_after += after;
+    code_free(C);
+  }
+
+  if (report)
+    fprintf(stderr, "register forms: %zu -> %zu instructions\n",
+            total_before, total_after);
+}
@@ -0,0 +1,18 @@
+/* C0VM register forms
+ * Replaces stack code that only moves values between locals by the
+ * register instructions from c0vm.h
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_REGS_H_
+#define _C0VM_REGS_H_
+
+/* Translates every function of a verified program.  Must run after the
+ * last verify_program(), which does not accept register forms.  With
+ * report set, prints the instruction counts before and after. */
+void translate_registers(struct bc0_file *bc0, bool report)
+  /*@requires bc0 != NULL; @*/ ;
+
+#endif /* _C0VM_REGS_H_ */
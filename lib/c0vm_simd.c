@@ -0,0 +1,272 @@
+/* C0VM bulk string natives
+ *
+ * Three kernels do the work: the length of a string, the first index
+ * where two strings differ or both end, and copying a string while
+ * mapping 'A'..'Z' to 'a'..'z'.  Each has a scalar version and, on
+ * x86-64, an SSE2 and an AVX2 version; simd_init() picks one of them
+ * once, by what the CPU supports.  execute() quickens string_length and
+ * string_equal to intrinsics, which call the same kernels.
+ *
+ * The kernels that look for the end of a string may not read past it
+ * into an unmapped page.  string_length loads aligned blocks, which
+ * never cross a page; the difference kernel reads two strings with
+ * unrelated alignments, so it goes one byte at a time while either
+ * block would cross a page.  The other kernels know their lengths.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_abort.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define PAGE_SIZE 4096
+
+/* Whether the width bytes at p reach into the next page */
+static inline bool crosses_page(const char *p, size_t width) {
+  return ((uintptr_t)p & (PAGE_SIZE - 1)) > PAGE_SIZE - width;
+}
+
+
+/*** Scalar ***/
+
+static size_t length_scalar(const char *s) {
+  size_t i = 0;
+  while (s[i] != '\0') i++;
+  return i;
+}
+
+static size_t diff_scalar(const char *s, const char *t) {
+  size_t i = 0;
+  while (s[i] == t[i] && s[i] != '\0') i++;
+  return i;
+}
+
+static void lower_scalar(char *dst, const char *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    char c = src[i];
+    dst[i] = 'A' <= c && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+  }
+}
+
+
+#ifdef SIMD_X86
+
+/*** SSE2 ***/
+
+static size_t length_sse2(const char *s) {
+  const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+  __m128i zero = _mm_setzero_si128();
+  unsigned mask = (unsigned)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+  mask >>= s - p;
+  if (mask != 0) return (size_t)__builtin_ctz(mask);
+  for (;;) {
+    p += 16;
+    mask = (unsigned)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+    if (mask != 0) return (size_t)(p - s) + (size_t)__builtin_ctz(mask);
+  }
+}
+
+static size_t diff_sse2(const char *s, const char *t) {
+  __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (;;) {
+    if (crosses_page(s + i, 16) || crosses_page(t + i, 16)) {
+      if (s[i] != t[i] || s[i] == '\0') return i;
+      i++;
+      continue;
+    }
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(t + i));
+    unsigned ne = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF;
+    unsigned end = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero));
+    if ((ne | end) != 0) return i + (size_t)__builtin_ctz(ne | end);
+    i += 16;
+  }
+}
+
+static void lower_sse2(char *dst, const char *src, size_t n) {
+  __m128i below = _mm_set1_epi8('A' - 1);
+  __m128i above = _mm_set1_epi8('Z' + 1);
+  __m128i bit = _mm_set1_epi8('a' - 'A');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, below),
+                                  _mm_cmplt_epi8(x, above));
+    x = _mm_or_si128(x, _mm_and_si128(upper, bit));
+    _mm_storeu_si128((__m128i *)(dst + i), x);
+  }
+  lower_scalar(dst + i, src + i, n - i);
+}
+
+
+/*** AVX2 ***/
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static size_t length_avx2(const char *s) {
+  const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+  __m256i zero = _mm256_setzero_si256();
+  uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+  mask >>= s - p;
+  if (mask != 0) return (size_t)__builtin_ctz(mask);
+  for (;;) {
+    p += 32;
+    mask = (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+    if (mask != 0) return (size_t)(p - s) + (size_t)__builtin_ctz(mask);
+  }
+}
+
+AVX2 static size_t diff_avx2(const char *s, const char *t) {
+  __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (;;) {
+    if (crosses_page(s + i, 32) || crosses_page(t + i, 32)) {
+      if (s[i] != t[i] || s[i] == '\0') return i;
+      i++;
+      continue;
+    }
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(t + i));
+    uint32_t ne = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    uint32_t end = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero));
+    if ((ne | end) != 0) return i + (size_t)__builtin_ctz(ne | end);
+    i += 32;
+  }
+}
+
+AVX2 static void lower_avx2(char *dst, const char *src, size_t n) {
+  __m256i below = _mm256_set1_epi8('A' - 1);
+  __m256i above = _mm256_set1_epi8('Z' + 1);
+  __m256i bit = _mm256_set1_epi8('a' - 'A');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, below),
+                                     _mm256_cmpgt_epi8(above, x));
+    x = _mm256_or_si256(x, _mm256_and_si256(upper, bit));
+    _mm256_storeu_si256((__m256i *)(dst + i), x);
+  }
+  lower_sse2(dst + i, src + i, n - i);
+}
+
+#endif /* SIMD_X86 */
+
+
+static size_t simd_level = SIMD_OFF;
+size_t (*simd_length)(const char *s) = strlen;
+size_t (*simd_diff)(const char *s, const char *t) = diff_scalar;
+static void (*lower)(char *dst, const char *src, size_t n) = lower_scalar;
+
+size_t simd_init(size_t level) {
+  // With the library's natives, the intrinsics use the library's strlen()
+  simd_length = level == SIMD_OFF ? strlen : length_scalar;
+  simd_diff = diff_scalar;
+  lower = lower_scalar;
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (level >= SIMD_AVX2 && !__builtin_cpu_supports("avx2"))
+    level = SIMD_SSE2;
+  if (level >= SIMD_AVX2) {
+    level = SIMD_AVX2;
+    simd_length = length_avx2;
+    simd_diff = diff_avx2;
+    lower = lower_avx2;
+  } else if (level == SIMD_SSE2) {
+    simd_length = length_sse2;
+    simd_diff = diff_sse2;
+    lower = lower_sse2;
+  }
+#else
+  if (level > SIMD_SCALAR) level = SIMD_SCALAR;
+#endif
+  simd_level = level;
+  return level;
+}
+
+
+/*** The natives ***/
+
+/* The library treats NULL as the empty string */
+static char *chars(c0_value v) {
+  char *s = val2ptr(v);
+  return s == NULL ? "" : s;
+}
+
+static c0_value string_length(c0_value *args) {
+  return int2val((int)simd_length(chars(args[0])));
+}
+
+static c0_value string_equal(c0_value *args) {
+  char *s = chars(args[0]);
+  char *t = chars(args[1]);
+  size_t i = simd_diff(s, t);
+  return int2val(s[i] == t[i]);
+}
+
+static c0_value string_compare(c0_value *args) {
+  char *s = chars(args[0]);
+  char *t = chars(args[1]);
+  size_t i = simd_diff(s, t);
+  ubyte a = (ubyte)s[i];
+  ubyte b = (ubyte)t[i];
+  return int2val(a < b ? -1 : a > b ? 1 : 0);
+}
+
+static c0_value string_tolower(c0_value *args) {
+  char *s = chars(args[0]);
+  size_t n = simd_length(s);
+  char *r = xmalloc(n + 1);
+  lower(r, s, n);
+  r[n] = '\0';
+  return ptr2val(r);
+}
+
+static c0_value string_to_chararray(c0_value *args) {
+  char *s = chars(args[0]);
+  size_t n = simd_length(s) + 1;
+  c0_array *A = xmalloc(sizeof(c0_array));
+  A->count = (int)n;
+  A->elt_size = 1;
+  A->elems = xmalloc(n);
+  memcpy(A->elems, s, n);
+  return ptr2val(A);
+}
+
+/* The array's length bounds the search, so this uses memchr() */
+static c0_value string_from_chararray(c0_value *args) {
+  c0_array *A = val2ptr(args[0]);
+  char *end = A == NULL ? NULL : memchr(A->elems, '\0', (size_t)A->count);
+  if (end == NULL) c0_user_error("string_from_chararray: not terminated");
+  size_t n = (size_t)(end - (char *)A->elems);
+  char *r = xmalloc(n + 1);
+  memcpy(r, A->elems, n + 1);
+  return ptr2val(r);
+}
+
+native_fn *simd_native(uint16_t function_table_index) {
+  if (simd_level == SIMD_OFF) return NULL;
+  switch (function_table_index) {
+  case NATIVE_STRING_LENGTH: return string_length;
+  case NATIVE_STRING_EQUAL: return string_equal;
+  case NATIVE_STRING_COMPARE: return string_compare;
+  case NATIVE_STRING_TOLOWER: return string_tolower;
+  case NATIVE_STRING_TO_CHARARRAY: return string_to_chararray;
+  case NATIVE_STRING_FROM_CHARARRAY: return string_from_chararray;
+  default: return NULL;
+  }
+}
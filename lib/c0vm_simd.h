@@ -0,0 +1,36 @@
+/* C0VM bulk string natives
+ * string_length, string_equal, string_compare, string_tolower,
+ * string_to_chararray and string_from_chararray, implemented by the VM
+ * with SSE2 or AVX2 where the CPU has them
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+
+#ifndef _C0VM_SIMD_H_
+#define _C0VM_SIMD_H_
+
+#define SIMD_OFF 0       // the library natives
+#define SIMD_SCALAR 1    // the VM's natives, one byte at a time
+#define SIMD_SSE2 2
+#define SIMD_AVX2 3
+
+/* Picks the widest implementation up to level that this CPU supports,
+ * and returns the level picked.  At SIMD_OFF, the natives are the
+ * library's, and so is simd_length (strlen). */
+size_t simd_init(size_t level);
+
+/* The kernels simd_init() picked, which the string_length and
+ * string_equal intrinsics of execute() call as well: the length of s,
+ * and the first index where s and t differ or both end.  Neither reads
+ * past the end of a string. */
+extern size_t (*simd_length)(const char *s);
+extern size_t (*simd_diff)(const char *s, const char *t);
+
+/* The VM's own version of native function_table_index, or NULL if the
+ * library version is used */
+native_fn *simd_native(uint16_t function_table_index);
+
+#endif /* _C0VM_SIMD_H_ */
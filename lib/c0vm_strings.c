@@ -0,0 +1,291 @@
+/* C0VM string table
+ *
+ * The region is reserved with MAP_NORESERVE, like the call stacks, and
+ * filled from the bottom; the string pool goes first, so every aldc
+ * operand still fits in 16 bits.  A hash table with linear probing
+ * finds the interned copy of a string.  When the region is full, new
+ * strings are simply not interned.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_strings.h"
+#include "c0vm_verify.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#define INTERN_REGION ((size_t)1 << 30)
+
+char *intern_base = NULL;
+char *intern_top = NULL;
+static char *intern_limit = NULL;
+
+size_t string_equal_calls = 0;
+size_t string_equal_fast = 0;
+
+struct intern_entry {
+  char *s;         // NULL for an empty slot
+  uint32_t hash;
+};
+
+static struct intern_entry *table = NULL;
+static size_t table_size = 0;    // a power of 2
+static size_t table_count = 0;
+
+static bool report_strings = false;
+static size_t lookups = 0;
+static size_t hits = 0;
+
+static uint32_t hash_string(char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) h = (h ^ (ubyte)s[i]) * 16777619u;
+  return h;
+}
+
+static void grow_table(void) {
+  struct intern_entry *old = table;
+  size_t old_size = table_size;
+  table_size = old_size == 0 ? 1024 : 2 * old_size;
+  table = xcalloc(table_size, sizeof(struct intern_entry));
+  for (size_t i = 0; i < old_size; i++) {
+    if (old[i].s == NULL) continue;
+    size_t j = old[i].hash & (table_size - 1);
+    while (table[j].s != NULL) j = (j + 1) & (table_size - 1);
+    table[j] = old[i];
+  }
+  free(old);
+}
+
+char *intern(char *s) {
+  REQUIRES(s != NULL);
+  if (is_interned(s)) return s;
+
+  size_t len = strlen(s);
+  uint32_t h = hash_string(s, len);
+  lookups++;
+  if (2 * (table_count + 1) > table_size) grow_table();
+  size_t j = h & (table_size - 1);
+  while (table[j].s != NULL) {
+    if (table[j].hash == h && strcmp(table[j].s, s) == 0) {
+      hits++;
+      return table[j].s;
+    }
+    j = (j + 1) & (table_size - 1);
+  }
+
+  if ((size_t)(intern_limit - intern_top) < len + 1) return s;
+  char *copy = intern_top;
+  memcpy(copy, s, len + 1);
+  intern_top += len + 1;
+  table[j].s = copy;
+  table[j].hash = h;
+  table_count++;
+  return copy;
+}
+
+static bool intern_runtime = false;
+
+void intern_program(struct bc0_file *bc0, bool runtime, bool report) {
+  REQUIRES(bc0 != NULL);
+
+  // Each distinct aldc operand adds at most its string to the new pool,
+  // which has to stay addressable by aldc
+  bool *seen = xcalloc((size_t)bc0->string_count + 1, sizeof(bool));
+  size_t bound = 0;
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    struct function_info *fi = &bc0->function_pool[f];
+    ubyte *P = fi->code;
+    for (size_t pc = 0; pc < fi->code_length; pc += instr_length(P[pc])) {
+      if (P[pc] != ALDC) continue;
+      size_t i = (size_t)(P[pc+1] << 8 | P[pc+2]);
+      if (seen[i]) continue;
+      seen[i] = true;
+      bound += strlen(&bc0->string_pool[i]) + 1;
+    }
+  }
+  free(seen);
+  if (bound > UINT16_MAX) return;
+
+  void *p = mmap(NULL, INTERN_REGION, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) return;  // strings stay where they are
+  intern_base = intern_top = p;
+  intern_limit = intern_base + INTERN_REGION;
+  intern_runtime = runtime;
+  report_strings = report;
+
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    struct function_info *fi = &bc0->function_pool[f];
+    ubyte *P = fi->code;
+    for (size_t pc = 0; pc < fi->code_length; pc += instr_length(P[pc])) {
+      if (P[pc] != ALDC) continue;
+      char *s = intern(&bc0->string_pool[P[pc+1] << 8 | P[pc+2]]);
+      size_t offset = (size_t)(s - intern_base);
+      P[pc+1] = (ubyte)(offset >> 8);
+      P[pc+2] = (ubyte)(offset & 0xFF);
+    }
+  }
+
+  size_t pool = (size_t)bc0->string_count;
+  bc0->string_pool = intern_base;
+  bc0->string_count = (uint16_t)(intern_top - intern_base);
+  if (report) {
+    fprintf(stderr, "string pool: %zu -> %zu bytes, %zu literals\n",
+            pool, (size_t)bc0->string_count, table_count);
+  }
+}
+
+/* The string natives, with their results interned */
+#define INTERNED(name) \
+  static c0_value interned_##name(c0_value *args) { \
+    char *s = val2ptr(__c0ffi_##name(args)); \
+    return ptr2val(s == NULL ? NULL : intern(s)); \
+  }
+
+INTERNED(string_join)
+INTERNED(string_sub)
+INTERNED(string_fromint)
+INTERNED(string_frombool)
+INTERNED(string_fromchar)
+INTERNED(string_from_chararray)
+INTERNED(string_tolower)
+
+native_fn *strings_native(uint16_t function_table_index) {
+  if (!intern_runtime) return NULL;
+  switch (function_table_index) {
+  case NATIVE_STRING_JOIN: return interned_string_join;
+  case NATIVE_STRING_SUB: return interned_string_sub;
+  case NATIVE_STRING_FROMINT: return interned_string_fromint;
+  case NATIVE_STRING_FROMBOOL: return interned_string_frombool;
+  case NATIVE_STRING_FROMCHAR: return interned_string_fromchar;
+  case NATIVE_STRING_FROM_CHARARRAY: return interned_string_from_chararray;
+  case NATIVE_STRING_TOLOWER: return interned_string_tolower;
+  default: return NULL;
+  }
+}
+
+
+/*** VM strings ***/
+
+/* Shorter results of string_join are plain char* */
+#define ROPE_MIN 64
+
+/* VM strings are never freed, so they are carved out of large blocks */
+#define NODE_BLOCK 4096
+
+static struct vm_string *new_node(void) {
+  static struct vm_string *block = NULL;
+  static size_t used = NODE_BLOCK;
+  if (used == NODE_BLOCK) {
+    block = xmalloc(NODE_BLOCK * sizeof(struct vm_string));
+    used = 0;
+  }
+  return &block[used++];
+}
+
+/* Writes the characters of s so that they end right before end.  The
+ * longer child of each node is handled by the loop and only the shorter
+ * one recursively, so the recursion is at most log2(length) deep however
+ * the rope was built, by appending or by prepending. */
+static void flatten_into(void *s, char *end) {
+  while (is_vmstring(s)) {
+    struct vm_string *S = vmstring(s);
+    if (S->flat != NULL || S->right == NULL) {
+      memcpy(end - S->length, string_span(s), S->length);
+      return;
+    }
+    size_t right = string_length_vm(S->right);
+    if (S->length - right <= right) {
+      flatten_into(S->left, end - right);
+      s = S->right;
+    } else {
+      flatten_into(S->right, end);
+      end -= right;
+      s = S->left;
+    }
+  }
+  size_t len = strlen(s);
+  memcpy(end - len, s, len);
+}
+
+char *flatten(struct vm_string *S) {
+  REQUIRES(S->flat == NULL);
+  char *flat = xmalloc(S->length + 1);
+  flat[S->length] = '\0';
+  if (S->right == NULL) {
+    memcpy(flat, (char *)S->left + S->offset, S->length);
+  } else {
+    flatten_into(S->left, flat + string_length_vm(S->left));
+    flatten_into(S->right, flat + S->length);
+  }
+  S->flat = flat;
+  return flat;
+}
+
+void *string_join_vm(void *s, void *t) {
+  REQUIRES(s != NULL && t != NULL);
+  size_t m = string_length_vm(s);
+  size_t n = string_length_vm(t);
+  if (m + n < ROPE_MIN) {
+    char *r = xmalloc(m + n + 1);
+    memcpy(r, string_span(s), m);
+    memcpy(r + m, string_span(t), n);
+    r[m + n] = '\0';
+    return r;
+  }
+  struct vm_string *S = new_node();
+  S->length = m + n;
+  S->flat = NULL;
+  S->left = s;
+  S->right = t;
+  S->offset = 0;
+  return (void *)((uintptr_t)S | VMSTRING_MASK);
+}
+
+void *string_sub_vm(void *s, size_t start, size_t end) {
+  REQUIRES(s != NULL && start <= end);
+  if (start == end) return "";
+  if (start == 0 && end == string_length_vm(s)) return s;
+
+  // A view of a view is a view of the same characters
+  char *base = string_span(s);
+  if (is_vmstring(s) && vmstring(s)->flat == NULL) {
+    struct vm_string *V = vmstring(s);
+    base = V->left;
+    start += V->offset;
+    end += V->offset;
+  }
+  return string_view_vm(base, start, end);
+}
+
+void *string_view_vm(char *base, size_t start, size_t end) {
+  REQUIRES(base != NULL && start <= end);
+  if (start == end) return "";
+  struct vm_string *S = new_node();
+  S->length = end - start;
+  S->flat = NULL;
+  S->left = base;
+  S->right = NULL;
+  S->offset = start;
+  return (void *)((uintptr_t)S | VMSTRING_MASK);
+}
+
+void strings_done(void) {
+  if (!report_strings) return;
+  fprintf(stderr, "string table: %zu strings, %zu bytes, %zu of %zu "
+          "lookups found\n", table_count, (size_t)(intern_top - intern_base),
+          hits, lookups);
+  fprintf(stderr, "string_equal: %zu of %zu calls by address\n",
+          string_equal_fast, string_equal_calls);
+  report_strings = false;
+}
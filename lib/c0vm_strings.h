@@ -0,0 +1,129 @@
+/* C0VM strings
+ *
+ * Interned strings live in one reserved region, so whether a string is
+ * interned is a range check.  Two different interned strings are never
+ * equal, and string_equal on two interned strings only compares their
+ * addresses.
+ *
+ * A C0 string is either a char* or, with the pointer type VMSTRING_BITS
+ * (lib/c0vm.h), a VM string: the rope string_join builds when the
+ * result is long, so that appending to a string in a loop does not copy
+ * it every time, or the view string_sub returns into its argument.
+ * Natives only ever see char*: a VM string is flattened when it is
+ * passed to one, and keeps its flat copy.  The intrinsics work on views
+ * without flattening them.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+
+#ifndef _C0VM_STRINGS_H_
+#define _C0VM_STRINGS_H_
+
+/* Moves the string pool into the string table, one copy per distinct
+ * literal, and points every aldc at the copy.  With runtime set, the
+ * results of the string natives that build strings are interned too
+ * (see strings_native()).  With report set, prints the table's size,
+ * and strings_done() prints its statistics. */
+void intern_program(struct bc0_file *bc0, bool runtime, bool report)
+  /*@requires bc0 != NULL; @*/ ;
+
+/* If strings from native function_table_index are interned, the VM
+ * version that interns them, otherwise NULL */
+native_fn *strings_native(uint16_t function_table_index);
+
+/* The interned copy of s */
+char *intern(char *s)
+  /*@requires s != NULL; @*/ ;
+
+static inline bool is_interned(char *s);
+
+/* string_equal calls, and those decided by the addresses alone */
+extern size_t string_equal_calls;
+extern size_t string_equal_fast;
+
+/* Prints the statistics, if asked to */
+void strings_done(void);
+
+struct vm_string {
+  size_t length;
+  char *flat;      // the characters, once needed, or NULL
+  void *left;      // char* or marked VM string, never NULL
+  void *right;     // the same, or NULL for a view
+  size_t offset;   // a view is left[offset, offset+length), left a char*
+};
+
+/* The string s ^ t, as a VM string if it is long enough to be worth it.
+ * Neither s nor t may be NULL. */
+void *string_join_vm(void *s, void *t)
+  /*@requires s != NULL && t != NULL; @*/ ;
+
+/* s[start, end), as a view if that is worth it.  s may not be NULL,
+ * and 0 <= start <= end <= the length of s. */
+void *string_sub_vm(void *s, size_t start, size_t end)
+  /*@requires s != NULL && start <= end; @*/ ;
+
+/* base[start, end) as a view.  Unlike string_sub_vm(), base need not
+ * end in '\0', and is only ever read in that range. */
+void *string_view_vm(char *base, size_t start, size_t end)
+  /*@requires base != NULL && start <= end; @*/ ;
+
+/* The characters of string s, which may be a VM string */
+static inline char *string_chars(void *s);
+
+/* The first character of s; unlike string_chars(), views are not
+ * copied, so only string_length_vm(s) characters may be read */
+static inline char *string_span(void *s)
+  /*@requires s != NULL; @*/ ;
+
+/* Replaces a VM string in v by its characters */
+static inline void flatten_value(c0_value *v);
+
+static inline size_t string_length_vm(void *s)
+  /*@requires s != NULL; @*/ ;
+
+
+/*** Implementation ***/
+
+extern char *intern_base;
+extern char *intern_top;
+
+static inline bool is_interned(char *s) {
+  return (uintptr_t)s - (uintptr_t)intern_base
+         < (uintptr_t)intern_top - (uintptr_t)intern_base;
+}
+
+char *flatten(struct vm_string *S);
+
+static inline struct vm_string *vmstring(void *s) {
+  return (struct vm_string *)((uintptr_t)s ^ VMSTRING_MASK);
+}
+
+static inline char *string_chars(void *s) {
+  if (!is_vmstring(s)) return s;
+  struct vm_string *S = vmstring(s);
+  return S->flat != NULL ? S->flat : flatten(S);
+}
+
+static inline char *string_span(void *s) {
+  if (!is_vmstring(s)) return s;
+  struct vm_string *S = vmstring(s);
+  if (S->flat != NULL) return S->flat;
+  if (S->right == NULL) return (char *)S->left + S->offset;
+  return flatten(S);
+}
+
+static inline void flatten_value(c0_value *v) {
+  if (v->kind == C0_POINTER && is_vmstring(v->payload.p))
+    *v = ptr2val(string_chars(v->payload.p));
+}
+
+static inline size_t string_length_vm(void *s) {
+  return is_vmstring(s) ? vmstring(s)->length : strlen(s);
+}
+
+#endif /* _C0VM_STRINGS_H_ */
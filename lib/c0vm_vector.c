@@ -0,0 +1,467 @@
+/* C0VM vector loops
+ *
+ * A kernel is the body of a counted loop compiled into operations on
+ * whole registers of BLOCK lanes, lane k standing for iteration b+k of
+ * the block starting at b.  The body is read by running it on a stack
+ * of symbolic values: constants, invariant locals, i+c and i+c+x stay
+ * symbolic until an operation needs them in a register, so that they
+ * can still be array indices.  A local the body stores to holds the
+ * symbolic value stored, so it may only be loaded after that store, in
+ * the same iteration.
+ *
+ * Every operation a kernel keeps can only fail on an array access, or
+ * on a division or shift by a constant, which the compiler rejects
+ * when it is out of range.  vector_run() checks every access of every
+ * iteration up front, from the first and last index of each: none may
+ * be out of bounds, and an array that is stored to may only be
+ * accessed at the same index through other locals, so that each lane
+ * reads and writes only its own elements.  In program order, one
+ * operation at a time over the whole block, that is the order of the
+ * iterations as far as any of them can tell.
+ *
+ * The last iteration is always left to the loop, so that the locals
+ * the body stores to end up holding what they would have.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_decode.h"
+#include "c0vm_vector.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define BLOCK 256
+#define MAX_VARS 256
+#define MAX_STACK 16
+#define MAX_REGS 32
+#define MAX_CODE 64
+#define MAX_ACCESSES 16
+
+enum vop {
+  V_CONST,    /* dst = arg, in every lane, once per run */
+  V_LOCAL,    /* dst = V[arg], likewise */
+  V_INDEX,    /* dst = i + arg */
+  V_LOAD,     /* dst = the elements of access arg */
+  V_STORE,    /* the elements of access arg = a */
+  V_ADD, V_SUB, V_MUL, V_AND, V_OR, V_XOR,   /* dst = a op b */
+  V_SHL, V_SHR, V_DIV, V_REM                 /* dst = a op arg */
+};
+
+struct vinstr {
+  enum vop op;
+  uint8_t dst, a, b;
+  int32_t arg;
+};
+
+/* Element i + offset (+ V[local]) of the array in V[array] */
+struct access {
+  int32_t array;
+  int32_t offset;
+  int32_t local;     // -1 for none
+  bool store;
+};
+
+struct kernel {
+  int32_t i;
+  bool bound_is_local;
+  int32_t bound;     // the local, or the constant
+  size_t num_accesses;
+  struct access accesses[MAX_ACCESSES];
+  size_t len;
+  struct vinstr code[MAX_CODE];
+  size_t num_regs;
+};
+
+static struct kernel *kernels = NULL;
+static size_t num_kernels = 0;
+static size_t kernels_capacity = 0;
+
+size_t vector_kernel_count(void) {
+  return num_kernels;
+}
+
+
+/*** The compiler ***/
+
+enum sym_kind { SYM_REG, SYM_CONST, SYM_LOCAL, SYM_INDEX, SYM_ADDR };
+
+struct sym {
+  enum sym_kind kind;
+  int32_t value;     // register, constant, local, or the array's local
+  int32_t offset;    // SYM_INDEX, SYM_ADDR: i + offset (+ V[local])
+  int32_t local;
+};
+
+struct builder {
+  struct kernel K;
+  bool stored[MAX_VARS];   // locals the body stores to
+  bool bound[MAX_VARS];    // and those it has stored to so far,
+  struct sym value[MAX_VARS];   // with their values
+  struct sym stack[MAX_STACK];
+  size_t sp;
+};
+
+/* Appends an operation, returning its destination register, or -1 if
+ * the kernel is full */
+static int emit(struct kernel *K, enum vop op, int a, int b, int32_t arg) {
+  if (K->len == MAX_CODE || K->num_regs == MAX_REGS) return -1;
+  int dst = (int)K->num_regs;
+  if (op != V_STORE) K->num_regs++;
+  K->code[K->len++] = (struct vinstr){ op, (uint8_t)dst, (uint8_t)a,
+                                       (uint8_t)b, arg };
+  return dst;
+}
+
+/* The register holding s, or -1 */
+static int materialize(struct kernel *K, struct sym s) {
+  switch (s.kind) {
+  case SYM_REG:
+    return s.value;
+  case SYM_CONST:
+    return emit(K, V_CONST, 0, 0, s.value);
+  case SYM_LOCAL:
+    return emit(K, V_LOCAL, 0, 0, s.value);
+  case SYM_INDEX: {
+    int r = emit(K, V_INDEX, 0, 0, s.offset);
+    if (r < 0 || s.local < 0) return r;
+    int x = emit(K, V_LOCAL, 0, 0, s.local);
+    return x < 0 ? -1 : emit(K, V_ADD, r, x, 0);
+  }
+  default:
+    return -1;
+  }
+}
+
+static int add_access(struct kernel *K, struct sym addr, bool store) {
+  if (K->num_accesses == MAX_ACCESSES) return -1;
+  K->accesses[K->num_accesses] =
+      (struct access){ addr.value, addr.offset, addr.local, store };
+  return (int)K->num_accesses++;
+}
+
+static bool push(struct builder *B, struct sym s) {
+  if (B->sp == MAX_STACK) return false;
+  B->stack[B->sp++] = s;
+  return true;
+}
+
+static bool push_reg(struct builder *B, int r) {
+  return r >= 0 && push(B, (struct sym){ SYM_REG, r, 0, -1 });
+}
+
+static enum vop arith(ubyte op) {
+  switch (op) {
+  case IADD: return V_ADD;
+  case ISUB: return V_SUB;
+  case IMUL: return V_MUL;
+  case IAND: return V_AND;
+  case IOR: return V_OR;
+  case IXOR: return V_XOR;
+  case ISHL: return V_SHL;
+  case ISHR: return V_SHR;
+  case IDIV: return V_DIV;
+  default: return V_REM;
+  }
+}
+
+/* x op y, with x and y popped already */
+static bool binary(struct builder *B, ubyte op, struct sym x, struct sym y) {
+  struct kernel *K = &B->K;
+
+  // Index arithmetic stays symbolic
+  if (op == IADD && y.kind == SYM_INDEX) {
+    struct sym t = x;
+    x = y;
+    y = t;
+  }
+  if (x.kind == SYM_INDEX && y.kind == SYM_CONST
+      && (op == IADD || op == ISUB)) {
+    x.offset = op == IADD ? x.offset + y.value : x.offset - y.value;
+    return push(B, x);
+  }
+  if (op == IADD && x.kind == SYM_INDEX && x.local < 0
+      && y.kind == SYM_LOCAL) {
+    x.local = y.value;
+    return push(B, x);
+  }
+
+  if (op == ISHL || op == ISHR || op == IDIV || op == IREM) {
+    // Only by constants that cannot raise an error
+    if (y.kind != SYM_CONST) return false;
+    if ((op == ISHL || op == ISHR) && !(0 <= y.value && y.value <= 31))
+      return false;
+    if ((op == IDIV || op == IREM) && (y.value == 0 || y.value == -1))
+      return false;
+    int a = materialize(K, x);
+    return a >= 0 && push_reg(B, emit(K, arith(op), a, 0, y.value));
+  }
+
+  int a = materialize(K, x);
+  int b = a < 0 ? -1 : materialize(K, y);
+  return b >= 0 && push_reg(B, emit(K, arith(op), a, b, 0));
+}
+
+static bool step(struct builder *B, struct bc0_file *bc0, instr in) {
+  struct kernel *K = &B->K;
+  struct sym x, y;
+  switch (in.op) {
+  case NOP:
+    return true;
+
+  case BIPUSH:
+    return push(B, (struct sym){ SYM_CONST, in.arg, 0, -1 });
+  case ILDC:
+    return push(B, (struct sym){ SYM_CONST, bc0->int_pool[in.arg], 0, -1 });
+
+  case VLOAD:
+    if (in.arg == K->i)
+      return push(B, (struct sym){ SYM_INDEX, 0, 0, -1 });
+    if (B->bound[in.arg]) return push(B, B->value[in.arg]);
+    if (B->stored[in.arg]) return false;   // from the previous iteration
+    return push(B, (struct sym){ SYM_LOCAL, in.arg, 0, -1 });
+
+  case VSTORE:
+    if (in.arg == K->i || B->sp < 1) return false;
+    x = B->stack[--B->sp];
+    B->bound[in.arg] = true;
+    B->value[in.arg] = x;
+    return x.kind != SYM_ADDR;
+
+  case DUP:
+    return B->sp >= 1 && push(B, B->stack[B->sp-1]);
+  case POP:
+    if (B->sp < 1) return false;
+    B->sp--;
+    return true;
+  case SWAP:
+    if (B->sp < 2) return false;
+    x = B->stack[B->sp-1];
+    B->stack[B->sp-1] = B->stack[B->sp-2];
+    B->stack[B->sp-2] = x;
+    return true;
+
+  case IADD: case ISUB: case IMUL: case IAND: case IOR: case IXOR:
+  case ISHL: case ISHR: case IDIV: case IREM:
+    if (B->sp < 2) return false;
+    y = B->stack[--B->sp];
+    x = B->stack[--B->sp];
+    if (x.kind == SYM_ADDR || y.kind == SYM_ADDR) return false;
+    return binary(B, in.op, x, y);
+
+  case AADDS:
+    if (B->sp < 2) return false;
+    y = B->stack[--B->sp];
+    x = B->stack[--B->sp];
+    if (x.kind != SYM_LOCAL || y.kind != SYM_INDEX) return false;
+    return push(B, (struct sym){ SYM_ADDR, x.value, y.offset, y.local });
+
+  case IMLOAD: {
+    if (B->sp < 1 || B->stack[B->sp-1].kind != SYM_ADDR) return false;
+    int a = add_access(K, B->stack[--B->sp], false);
+    return a >= 0 && push_reg(B, emit(K, V_LOAD, 0, 0, a));
+  }
+
+  case IMSTORE: {
+    if (B->sp < 2 || B->stack[B->sp-2].kind != SYM_ADDR) return false;
+    int r = materialize(K, B->stack[B->sp-1]);
+    int a = r < 0 ? -1 : add_access(K, B->stack[B->sp-2], true);
+    B->sp -= 2;
+    return a >= 0 && emit(K, V_STORE, r, 0, a) >= 0;
+  }
+
+  default:
+    return false;
+  }
+}
+
+bool vector_compile(struct bc0_file *bc0, instr *I, size_t n,
+                    int32_t i, instr bound, uint16_t *kernel) {
+  REQUIRES(bc0 != NULL && kernel != NULL);
+  if (num_kernels > UINT16_MAX) return false;
+
+  struct builder *B = xcalloc(1, sizeof(struct builder));
+  B->K.i = i;
+  bool ok = true;
+  for (size_t k = 0; k < n; k++) {
+    if ((I[k].op == VLOAD || I[k].op == VSTORE) && I[k].arg >= MAX_VARS)
+      ok = false;
+    else if (I[k].op == VSTORE)
+      B->stored[I[k].arg] = true;
+  }
+
+  if (bound.op == VLOAD) {
+    B->K.bound_is_local = true;
+    B->K.bound = bound.arg;
+    ok = ok && bound.arg != i && bound.arg < MAX_VARS
+         && !B->stored[bound.arg];
+  } else {
+    B->K.bound = bound.op == BIPUSH ? bound.arg : bc0->int_pool[bound.arg];
+  }
+  for (size_t k = 0; k < n && ok; k++) ok = step(B, bc0, I[k]);
+
+  bool stores = false;
+  for (size_t a = 0; a < B->K.num_accesses; a++)
+    stores = stores || B->K.accesses[a].store;
+  ok = ok && B->sp == 0 && stores;
+
+  if (ok) {
+    if (num_kernels == kernels_capacity) {
+      kernels_capacity = kernels_capacity == 0 ? 8 : 2 * kernels_capacity;
+      struct kernel *table = xcalloc(kernels_capacity, sizeof(struct kernel));
+      if (num_kernels > 0)
+        memcpy(table, kernels, num_kernels * sizeof(struct kernel));
+      free(kernels);
+      kernels = table;
+    }
+    kernels[num_kernels] = B->K;
+    *kernel = (uint16_t)num_kernels++;
+  }
+  free(B);
+  return ok;
+}
+
+
+/*** Lanes ***/
+
+/* The operations on m lanes; with SSE2, four at a time */
+#ifdef SIMD_X86
+#define LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define LANES_SSE2(expr) \
+  for (; k + 4 <= m; k += 4) { \
+    __m128i x = LOAD(a + k); \
+    __m128i y = LOAD(b + k); \
+    STORE(d + k, expr); \
+  }
+
+/* The low 32 bits of each product; SSE2 only multiplies even lanes */
+static inline __m128i mullo(__m128i x, __m128i y) {
+  __m128i even = _mm_mul_epu32(x, y);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#else
+#define LANES_SSE2(expr)
+#endif
+
+#define LANES(name, vector, scalar) \
+  static void name(int32_t *d, const int32_t *a, const int32_t *b, \
+                   size_t m) { \
+    size_t k = 0; \
+    LANES_SSE2(vector) \
+    for (; k < m; k++) d[k] = scalar; \
+  }
+
+LANES(lanes_add, _mm_add_epi32(x, y), a[k] + b[k])
+LANES(lanes_sub, _mm_sub_epi32(x, y), a[k] - b[k])
+LANES(lanes_mul, mullo(x, y),
+      (int32_t)((uint32_t)a[k] * (uint32_t)b[k]))
+LANES(lanes_and, _mm_and_si128(x, y), a[k] & b[k])
+LANES(lanes_or, _mm_or_si128(x, y), a[k] | b[k])
+LANES(lanes_xor, _mm_xor_si128(x, y), a[k] ^ b[k])
+
+static void lanes_shift(int32_t *d, const int32_t *a, int32_t s, bool left,
+                        size_t m) {
+  size_t k = 0;
+#ifdef SIMD_X86
+  __m128i count = _mm_cvtsi32_si128(s);
+  for (; k + 4 <= m; k += 4) {
+    __m128i x = LOAD(a + k);
+    STORE(d + k, left ? _mm_sll_epi32(x, count) : _mm_sra_epi32(x, count));
+  }
+#endif
+  for (; k < m; k++) d[k] = left ? a[k] << s : a[k] >> s;
+}
+
+/* No instruction divides ints; the divisor is neither 0 nor -1 */
+static void lanes_div(int32_t *d, const int32_t *a, int32_t y, bool rem,
+                      size_t m) {
+  for (size_t k = 0; k < m; k++) d[k] = rem ? a[k] % y : a[k] / y;
+}
+
+
+/*** Running ***/
+
+static int32_t regs[MAX_REGS][BLOCK];
+
+void vector_run(uint16_t k, c0_value *V) {
+  REQUIRES(k < num_kernels);
+  struct kernel *K = &kernels[k];
+  int64_t first = val2int(V[K->i]);
+  int64_t last = K->bound_is_local ? val2int(V[K->bound]) : K->bound;
+  last--;   // the loop's own
+  if (last - first < 1) return;
+
+  // Every access, from iteration first through last-1
+  c0_array *arrays[MAX_ACCESSES];
+  int64_t offsets[MAX_ACCESSES];
+  int32_t *elems[MAX_ACCESSES];
+  for (size_t a = 0; a < K->num_accesses; a++) {
+    struct access x = K->accesses[a];
+    c0_array *A = val2ptr(V[x.array]);
+    if (A == NULL || A->elt_size != 4) return;
+    int64_t offset = x.offset;
+    if (x.local >= 0) offset += val2int(V[x.local]);
+    if (first + offset < 0 || last - 1 + offset >= A->count) return;
+    arrays[a] = A;
+    offsets[a] = offset;
+    elems[a] = (int32_t *)A->elems + (first + offset);
+  }
+  for (size_t a = 0; a < K->num_accesses; a++) {
+    if (!K->accesses[a].store) continue;
+    for (size_t b = 0; b < K->num_accesses; b++)
+      if (arrays[b] == arrays[a] && offsets[b] != offsets[a]) return;
+  }
+
+  for (size_t j = 0; j < K->len; j++) {
+    struct vinstr in = K->code[j];
+    int32_t x = in.op == V_CONST ? in.arg
+              : in.op == V_LOCAL ? val2int(V[in.arg]) : 0;
+    if (in.op == V_CONST || in.op == V_LOCAL)
+      for (size_t l = 0; l < BLOCK; l++) regs[in.dst][l] = x;
+  }
+
+  for (int64_t b = first; b < last; b += BLOCK) {
+    size_t m = last - b < BLOCK ? (size_t)(last - b) : BLOCK;
+    size_t at = (size_t)(b - first);
+    for (size_t j = 0; j < K->len; j++) {
+      struct vinstr in = K->code[j];
+      int32_t *d = regs[in.dst];
+      int32_t *x = regs[in.a];
+      int32_t *y = regs[in.b];
+      switch (in.op) {
+      case V_CONST: case V_LOCAL:
+        break;
+      case V_INDEX:
+        for (size_t l = 0; l < m; l++)
+          d[l] = (int32_t)((uint32_t)b + (uint32_t)in.arg + (uint32_t)l);
+        break;
+      case V_LOAD:
+        memcpy(d, elems[in.arg] + at, m * sizeof(int32_t));
+        break;
+      case V_STORE:
+        memcpy(elems[in.arg] + at, x, m * sizeof(int32_t));
+        break;
+      case V_ADD: lanes_add(d, x, y, m); break;
+      case V_SUB: lanes_sub(d, x, y, m); break;
+      case V_MUL: lanes_mul(d, x, y, m); break;
+      case V_AND: lanes_and(d, x, y, m); break;
+      case V_OR: lanes_or(d, x, y, m); break;
+      case V_XOR: lanes_xor(d, x, y, m); break;
+      case V_SHL: lanes_shift(d, x, in.arg, true, m); break;
+      case V_SHR: lanes_shift(d, x, in.arg, false, m); break;
+      case V_DIV: lanes_div(d, x, in.arg, false, m); break;
+      case V_REM: lanes_div(d, x, in.arg, true, m); break;
+      }
+    }
+  }
+  V[K->i] = int2val((int32_t)last);
+}
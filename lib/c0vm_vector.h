@@ -0,0 +1,35 @@
+/* C0VM vector loops
+ * Element-wise loops over int arrays, run a block of iterations at a
+ * time with SSE2 where the CPU has it
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "c0vm.h"
+#include "c0vm_decode.h"
+
+#ifndef _C0VM_VECTOR_H_
+#define _C0VM_VECTOR_H_
+
+/* Compiles the body I[0..n) of a loop over local i, counting up by one
+ * while i < bound, into a kernel.  Returns false if the body is not
+ * something a kernel can run: straight-line int arithmetic on elements
+ * i+c (or i+c+x, for a local x the body does not store to) of int
+ * arrays in locals, with no calls and no values carried from one
+ * iteration to the next.  Otherwise, *kernel is its index. */
+bool vector_compile(struct bc0_file *bc0, instr *I, size_t n,
+                    int32_t i, instr bound, uint16_t *kernel)
+  /*@requires bc0 != NULL && kernel != NULL; @*/ ;
+
+/* The number of kernels compiled so far */
+size_t vector_kernel_count(void);
+
+/* Runs the iterations of kernel k's loop from the current value of i
+ * up to the last one, which is left to the loop itself, and updates i.
+ * If any of them would fail, or fewer than two are left, does nothing,
+ * so errors are raised by the loop exactly where they were. */
+void vector_run(uint16_t k, c0_value *V)
+  /*@requires k < vector_kernel_count(); @*/ ;
+
+#endif /* _C0VM_VECTOR_H_ */
@@ -0,0 +1,327 @@
+/* C0VM load-time bytecode checks
+ *
+ * A simple abstract interpretation over operand stack heights, in the
+ * style of the JVM verifier.  cc0 only produces code where every
+ * instruction is reached with the same stack height along all paths, so
+ * a single forward pass assigns each instruction its height.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_dynamic.h"
+#include "c0vm_vector.h"
+#include "c0vm_verify.h"
+
+size_t instr_length(ubyte opcode) {
+  switch (opcode) {
+  case IADD: case IAND: case IDIV: case IMUL: case IOR:
+  case IREM: case ISHL: case ISHR: case ISUB: case IXOR:
+  case DUP: case POP: case SWAP:
+  case ARRAYLENGTH: case AADDS:
+  case IMLOAD: case AMLOAD: case IMSTORE: case AMSTORE:
+  case CMLOAD: case CMSTORE:
+  case ACONST_NULL: case NOP: case ATHROW: case ASSERT:
+  case RETURN: case INVOKEDYNAMIC:
+    return 1;
+
+  case BIPUSH: case VLOAD: case VSTORE:
+  case NEW: case NEWARRAY: case AADDF:
+  case ARRAY_FILL: case ARRAY_COPY:
+    return 2;
+
+  case ILDC: case ALDC:
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+  case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE: case GOTO:
+  case INVOKESTATIC: case INVOKENATIVE:
+  case ADDROF_STATIC: case ADDROF_NATIVE:
+  case CHECKTAG: case HASTAG: case ADDTAG:
+  case INVOKETAIL: case VECTOR_LOOP: case INVOKEDYNAMIC_CACHED:
+  case INVOKE_STRING_LENGTH: case INVOKE_STRING_CHARAT:
+  case INVOKE_CHAR_ORD: case INVOKE_CHAR_CHR: case INVOKE_STRING_EQUAL:
+  case INVOKE_STRING_JOIN: case INVOKE_STRING_SUB:
+  case INVOKE_DADD: case INVOKE_DSUB: case INVOKE_DMUL: case INVOKE_DDIV:
+  case INVOKE_DLESS: case INVOKE_DTOI: case INVOKE_ITOD:
+  case INVOKE_FADD: case INVOKE_FSUB: case INVOKE_FMUL: case INVOKE_FDIV:
+  case INVOKE_FLESS: case INVOKE_FTOI: case INVOKE_ITOF:
+  case VMOVE: case VSET:
+    return 3;
+
+  case IADD_VV: case ISUB_VV: case IMUL_VV: case IDIV_VV: case IREM_VV:
+  case IAND_VV: case IOR_VV: case IXOR_VV: case ISHL_VV: case ISHR_VV:
+  case IADD_VI: case ISUB_VI: case IMUL_VI: case IDIV_VI: case IREM_VI:
+  case IAND_VI: case IOR_VI: case IXOR_VI: case ISHL_VI: case ISHR_VI:
+    return 4;
+
+  case IF_CMPEQ_VV: case IF_CMPNE_VV: case IF_ICMPLT_VV:
+  case IF_ICMPGE_VV: case IF_ICMPGT_VV: case IF_ICMPLE_VV:
+  case IF_CMPEQ_VI: case IF_CMPNE_VI: case IF_ICMPLT_VI:
+  case IF_ICMPGE_VI: case IF_ICMPGT_VI: case IF_ICMPLE_VI:
+    return 5;
+
+  default:
+    return 0;
+  }
+}
+
+static void verify_error(size_t f, size_t pc, char *msg) {
+  fprintf(stderr, "Error: function %zu, pc %zu: %s\n", f, pc, msg);
+  exit(EXIT_FAILURE);
+}
+
+static uint16_t operand16(ubyte *P, size_t pc) {
+  return (uint16_t)(P[pc+1] << 8 | P[pc+2]);
+}
+
+/* Number of values the instruction at P[pc] pops and pushes.  Also
+ * checks that its pool and local variable operands are in range. */
+static void stack_effect(struct bc0_file *bc0, size_t f, size_t pc,
+                         int *pops, int *pushes) {
+  struct function_info *fi = &bc0->function_pool[f];
+  ubyte *P = fi->code;
+
+  switch (P[pc]) {
+  case IADD: case IAND: case IDIV: case IMUL: case IOR:
+  case IREM: case ISHL: case ISHR: case ISUB: case IXOR:
+  case AADDS:
+    *pops = 2; *pushes = 1; return;
+
+  case IMSTORE: case AMSTORE: case CMSTORE: case ASSERT:
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+  case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE:
+    *pops = 2; *pushes = 0; return;
+
+  case POP: case ATHROW: case RETURN:
+    *pops = 1; *pushes = 0; return;
+
+  case DUP: *pops = 1; *pushes = 2; return;
+  case SWAP: *pops = 2; *pushes = 2; return;
+
+  case ARRAYLENGTH: case IMLOAD: case AMLOAD: case CMLOAD:
+  case NEWARRAY: case AADDF:
+  case CHECKTAG: case HASTAG: case ADDTAG:
+    *pops = 1; *pushes = 1; return;
+
+  case ACONST_NULL: case BIPUSH: case NEW:
+    *pops = 0; *pushes = 1; return;
+
+  case ADDROF_STATIC:
+    if (operand16(P, pc) >= bc0->function_count)
+      verify_error(f, pc, "addrof_static out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case ADDROF_NATIVE:
+    if (operand16(P, pc) >= bc0->native_count)
+      verify_error(f, pc, "addrof_native out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case NOP: case GOTO:
+    *pops = 0; *pushes = 0; return;
+
+  case VLOAD:
+    if (P[pc+1] >= fi->num_vars) verify_error(f, pc, "vload out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case VSTORE:
+    if (P[pc+1] >= fi->num_vars) verify_error(f, pc, "vstore out of range");
+    *pops = 1; *pushes = 0; return;
+
+  case ILDC:
+    if (operand16(P, pc) >= bc0->int_count)
+      verify_error(f, pc, "ildc out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case ALDC:
+    if (operand16(P, pc) >= bc0->string_count)
+      verify_error(f, pc, "aldc out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case INVOKESTATIC:
+    if (operand16(P, pc) >= bc0->function_count)
+      verify_error(f, pc, "invokestatic out of range");
+    *pops = bc0->function_pool[operand16(P, pc)].num_args;
+    *pushes = 1;
+    return;
+
+  case INVOKENATIVE:
+    if (operand16(P, pc) >= bc0->native_count)
+      verify_error(f, pc, "invokenative out of range");
+    *pops = bc0->native_pool[operand16(P, pc)].num_args;
+    *pushes = 1;
+    return;
+
+  case INVOKEDYNAMIC:
+    // Only the function pointer is known to be there
+    *pops = 1; *pushes = 1; return;
+
+  case INVOKEDYNAMIC_CACHED:
+    if (operand16(P, pc) >= call_site_count())
+      verify_error(f, pc, "invalid call site");
+    *pops = 1; *pushes = 1; return;
+
+  case ARRAY_FILL: case ARRAY_COPY:
+    // From the optimizer (lib/c0vm_loops.c), checked once more
+    if (P[pc+1] != 1 && P[pc+1] != 4)
+      verify_error(f, pc, "invalid array element size");
+    *pops = 4; *pushes = 1; return;
+
+  case VECTOR_LOOP:
+    if (operand16(P, pc) >= vector_kernel_count())
+      verify_error(f, pc, "invalid vector kernel");
+    *pops = 0; *pushes = 0; return;
+
+  default:
+    verify_error(f, pc, "invalid opcode");
+  }
+}
+
+/* Record height h for the instruction at target, reached from pc */
+static void join(int *heights, size_t *worklist, size_t *n,
+                 size_t f, size_t pc, size_t target, int h) {
+  if (heights[target] == -1) {
+    heights[target] = h;
+    worklist[(*n)++] = target;
+  } else if (heights[target] != h) {
+    verify_error(f, pc, "inconsistent operand stack height");
+  }
+}
+
+static bool is_jump(ubyte op) {
+  switch (op) {
+  case GOTO:
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+  case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* The checks that do not need stack heights, for a function with a
+ * dynamic call: every instruction in turn from the start, so that the
+ * code has to consist of whole instructions, as cc0's always does */
+static void check_instructions(struct bc0_file *bc0, size_t f) {
+  struct function_info *fi = &bc0->function_pool[f];
+  ubyte *P = fi->code;
+  size_t len = fi->code_length;
+
+  bool *start = xcalloc(len, sizeof(bool));
+  size_t last = 0;
+  for (size_t pc = 0; pc < len; pc += instr_length(P[pc])) {
+    size_t ilen = instr_length(P[pc]);
+    if (ilen == 0) verify_error(f, pc, "invalid opcode");
+    if (pc + ilen > len) verify_error(f, pc, "truncated instruction");
+    int pops, pushes;
+    stack_effect(bc0, f, pc, &pops, &pushes);
+    start[pc] = true;
+    last = pc;
+  }
+
+  for (size_t pc = 0; pc < len; pc += instr_length(P[pc])) {
+    if (!is_jump(P[pc])) continue;
+    long target = (long)pc + (int16_t)operand16(P, pc);
+    if (target < 0 || target >= (long)len)
+      verify_error(f, pc, "branch target out of range");
+    if (!start[target])
+      verify_error(f, pc, "branch into the middle of an instruction");
+  }
+  if (P[last] != RETURN && P[last] != ATHROW && P[last] != GOTO)
+    verify_error(f, last, "falls off end of code");
+
+  free(start);
+}
+
+bool stack_heights(struct bc0_file *bc0, size_t f, int *heights) {
+  REQUIRES(bc0 != NULL && f < bc0->function_count);
+
+  struct function_info *fi = &bc0->function_pool[f];
+  ubyte *P = fi->code;
+  size_t len = fi->code_length;
+
+  for (size_t pc = 0; pc < len; pc++) heights[pc] = -1;
+  if (len == 0) verify_error(f, 0, "empty function body");
+
+  // Every pc enters the worklist at most once
+  size_t *worklist = xcalloc(len, sizeof(size_t));
+  size_t n = 0;
+  heights[0] = 0;
+  worklist[n++] = 0;
+
+  while (n > 0) {
+    size_t pc = worklist[--n];
+    ubyte op = P[pc];
+    size_t ilen = instr_length(op);
+    if (ilen == 0) verify_error(f, pc, "invalid opcode");
+    if (pc + ilen > len) verify_error(f, pc, "truncated instruction");
+
+    if (op == INVOKEDYNAMIC || op == INVOKEDYNAMIC_CACHED) {
+      // The callee, and with it the height after the call, is only
+      // known at run time
+      free(worklist);
+      check_instructions(bc0, f);
+      return false;
+    }
+
+    int pops, pushes;
+    stack_effect(bc0, f, pc, &pops, &pushes);
+    int h = heights[pc];
+    if (h < pops) verify_error(f, pc, "operand stack underflow");
+    h = h - pops + pushes;
+
+    switch (op) {
+    case RETURN:
+    case ATHROW:
+      break;
+
+    case GOTO:
+    case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+    case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE: {
+      int16_t offset = (int16_t)operand16(P, pc);
+      long target = (long)pc + offset;
+      if (target < 0 || target >= (long)len)
+        verify_error(f, pc, "branch target out of range");
+      join(heights, worklist, &n, f, pc, (size_t)target, h);
+      if (op == GOTO) break;
+    }
+    /* fallthrough */
+
+    default:
+      if (pc + ilen >= len) verify_error(f, pc, "falls off end of code");
+      join(heights, worklist, &n, f, pc, pc + ilen, h);
+      break;
+    }
+  }
+
+  // Branches must land on instruction boundaries
+  for (size_t pc = 0; pc < len; pc += instr_length(P[pc])) {
+    if (instr_length(P[pc]) == 0) break; // unreachable garbage
+    for (size_t k = 1; k < instr_length(P[pc]) && pc + k < len; k++) {
+      if (heights[pc+k] != -1)
+        verify_error(f, pc + k, "branch into the middle of an instruction");
+    }
+  }
+
+  free(worklist);
+  return true;
+}
+
+void verify_program(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+
+  if (bc0->function_count == 0) {
+    fprintf(stderr, "Error: program has no main function\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t f = 0; f < bc0->function_count; f++) {
+    struct function_info *fi = &bc0->function_pool[f];
+    if (fi->num_args > fi->num_vars)
+      verify_error(f, 0, "more arguments than local variables");
+
+    int *heights = xcalloc(fi->code_length, sizeof(int));
+    stack_heights(bc0, f, heights);
+    free(heights);
+  }
+}
@@ -0,0 +1,31 @@
+/* C0VM load-time bytecode checks
+ *
+ * Computes the operand stack height before every instruction of a
+ * function, which also checks that the code can never underflow the
+ * operand stack or use an operand out of range.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_VERIFY_H_
+#define _C0VM_VERIFY_H_
+
+/* Length in bytes of an instruction with the given opcode,
+ * or 0 if the opcode is not a valid instruction */
+size_t instr_length(ubyte opcode);
+
+/* Fills heights[0..fi->code_length) with the operand stack height
+ * before each instruction, or -1 for bytes that are not the start of
+ * a reachable instruction.  Returns false if the heights could not be
+ * computed exactly (only INVOKEDYNAMIC, whose argument count is not
+ * known statically, causes this); its operands and branch targets are
+ * still checked then.  Exits on malformed code. */
+bool stack_heights(struct bc0_file *bc0, size_t f, int *heights)
+  /*@requires \length(heights) == bc0->function_pool[f].code_length; @*/ ;
+
+/* Checks every function, exiting on malformed code */
+void verify_program(struct bc0_file *bc0)
+  /*@requires bc0 != NULL; @*/ ;
+
+#endif /* _C0VM_VERIFY_H_ */
@@ -0,0 +1,127 @@
+/* Checks the natives of lib/c0vm_simd.c against the C library
+ *
+ *   make simd_test && ./simd_test
+ *
+ * Every string ends right before a page that cannot be read, at every
+ * alignment, so a kernel that reads past the end of a string faults.
+ * Each native is checked at every level the CPU supports.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../lib/xalloc.h"
+#include "../lib/c0vm.h"
+#include "../lib/c0vm_c0ffi.h"
+#include "../lib/c0vm_simd.h"
+
+#define MAX_LENGTH 200
+
+static size_t page;
+static int failures = 0;
+
+/* One readable page followed by one that is not */
+static char *guarded_page(void) {
+  void *p;
+  if (posix_memalign(&p, page, 2 * page) != 0) abort();
+  if (mprotect((char *)p + page, page, PROT_NONE) != 0) abort();
+  return p;
+}
+
+/* Copies s so that its '\0' is the last readable byte of P */
+static char *at_end(char *P, const char *s) {
+  size_t n = strlen(s) + 1;
+  return memcpy(P + page - n, s, n);
+}
+
+static int sign(int x) {
+  return x < 0 ? -1 : x > 0 ? 1 : 0;
+}
+
+static c0_value call(uint16_t native, char *s, char *t) {
+  c0_value args[2] = { ptr2val(s), ptr2val(t) };
+  return (*simd_native(native))(args);
+}
+
+static void check(bool ok, size_t level, char *what, const char *s) {
+  if (ok) return;
+  fprintf(stderr, "level %zu: %s wrong on \"%s\"\n", level, what, s);
+  failures++;
+}
+
+static void check_one(size_t level, char *s, char *t) {
+  check(val2int(call(NATIVE_STRING_LENGTH, s, t)) == (int)strlen(s),
+        level, "string_length", s);
+  check(simd_length(s) == strlen(s), level, "simd_length", s);
+  check(val2int(call(NATIVE_STRING_EQUAL, s, t)) == (strcmp(s, t) == 0),
+        level, "string_equal", s);
+  check(val2int(call(NATIVE_STRING_COMPARE, s, t)) == sign(strcmp(s, t)),
+        level, "string_compare", s);
+
+  char *r = val2ptr(call(NATIVE_STRING_TOLOWER, s, t));
+  bool ok = strlen(r) == strlen(s);
+  for (size_t i = 0; ok && s[i] != '\0'; i++)
+    ok = r[i] == tolower((unsigned char)s[i]);
+  check(ok, level, "string_tolower", s);
+  free(r);
+
+  c0_array *A = val2ptr(call(NATIVE_STRING_TO_CHARARRAY, s, t));
+  check(A->count == (int)strlen(s) + 1 && memcmp(A->elems, s, A->count) == 0,
+        level, "string_to_chararray", s);
+  c0_value args[1] = { ptr2val(A) };
+  r = val2ptr((*simd_native(NATIVE_STRING_FROM_CHARARRAY))(args));
+  check(strcmp(r, s) == 0, level, "string_from_chararray", s);
+  free(r);
+  free(A->elems);
+  free(A);
+}
+
+int main(void) {
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  char *P = guarded_page();
+  char *Q = guarded_page();
+  char buf[MAX_LENGTH + 2];
+
+  size_t last = SIMD_OFF;
+  for (size_t want = SIMD_SCALAR; want <= SIMD_AVX2; want++) {
+    size_t level = simd_init(want);
+    if (level == last) continue;
+    last = level;
+
+    for (size_t n = 0; n <= MAX_LENGTH; n++) {
+      for (size_t i = 0; i < n; i++) buf[i] = "Hello, WORLD! xyz"[i % 17];
+      buf[n] = '\0';
+      char *s = at_end(P, buf);
+
+      // Equal strings, and t differing from s at each index, or
+      // shorter or longer by one; t ends on its own page as well, so
+      // the two are at different alignments whenever the lengths differ
+      check_one(level, s, at_end(Q, buf));
+      for (size_t i = 0; i < n; i++) {
+        buf[i]++;
+        check_one(level, s, at_end(Q, buf));
+        buf[i]--;
+      }
+      if (n > 0) {
+        char c = buf[n - 1];
+        buf[n - 1] = '\0';
+        check_one(level, s, at_end(Q, buf));
+        buf[n - 1] = c;
+      }
+      if (n < MAX_LENGTH) {
+        buf[n] = 'a';
+        buf[n + 1] = '\0';
+        check_one(level, s, at_end(Q, buf));
+      }
+    }
+  }
+
+  if (failures > 0) return 1;
+  printf("simd natives agree with the C library up to level %zu\n", last);
+  return 0;
+}